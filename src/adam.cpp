@@ -1,62 +1,220 @@
 #include "adam.hpp"
+#include "graph.hpp"
 #include "value.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <iomanip>
 #include <cmath>
+#include <map>
+#include <stdexcept>
 
-Adam::Adam(int num_steps) {
+Adam::Adam(int num_steps, std::string checkpoint_path, int checkpoint_every) {
     this->num_steps = num_steps;
+    this->checkpoint_path = std::move(checkpoint_path);
+    this->checkpoint_every = checkpoint_every;
+    if (!this->checkpoint_path.empty())
+        writer = std::make_unique<CheckpointWriter>(this->checkpoint_path);
 }
 
-void Adam::train(Model& model, std::vector<std::string> docs, int BOS) {
-    // get params as a vector
-    vector_t parameters = model.get_all_parameters();
+void Adam::snapshot(Checkpoint& checkpoint) const {
+    checkpoint.step = step;
+    checkpoint.mom = mom;
+    checkpoint.vel = vel;
+}
 
-    // initialize moment buffers (first and second moment)
-    std::vector<double> mom(parameters.size(), 0.0);
-    std::vector<double> vel(parameters.size(), 0.0);
+void Adam::restore(const Checkpoint& checkpoint) {
+    step = checkpoint.step;
+    mom = checkpoint.mom;
+    vel = checkpoint.vel;
+    std::cout << "Resuming optimizer at step " << step << std::endl;
+}
 
-    // commence training
-    std::cout << "Training with num_steps=" << num_steps << std::endl;
-    for (int step = 0; step < num_steps; step++) {
-        std::string doc = docs[step % docs.size()];
-        std::vector<int> tokens{BOS,};
-        for (char ch : doc)
-            tokens.push_back(ch - 'a');
-        tokens.push_back(BOS);
+// shape of a batch: per sequence its number of positions and document boundaries.
+// batches of equal shape produce structurally identical graphs.
+static std::vector<int> batch_shape(const Batch& batch, int block_size, int BOS) {
+    std::vector<int> shape;
+    for (const std::vector<int>& tokens : batch.sequences) {
+        int n = std::min((size_t)block_size, tokens.size() - 1);
+        shape.push_back(n);
+        for (int i = 1; i < n; i++)
+            if (tokens[i] == BOS)
+                shape.push_back(-i);
+    }
+    return shape;
+}
 
+// build the mean loss graph of a batch, optionally recording its input slots for replay
+static value_t build_loss(Model& model, const Batch& batch, int BOS, Graph* graph) {
+    // mean loss over the positions of each document, averaged over the batch
+    vector_t doc_losses;
+    doc_losses.reserve(batch.sequences.size());
+    for (const std::vector<int>& tokens : batch.sequences) {
         // prepare KV tensors
         std::vector<matrix_t> keys, values;
         prepare_tensors(keys, values, model.n_layer);
 
         vector_t losses;
         int n = std::min((size_t)model.block_size, tokens.size() - 1);
-        for (int pos_id = 0; pos_id < n; pos_id++) {
-            int token_id = tokens[pos_id];
-            int target_id = tokens[pos_id + 1];
-            vector_t logits = model.gpt(token_id, pos_id, keys, values);
+        for (int i = 0, pos_id = 0; i < n; i++, pos_id++) {
+            int token_id = tokens[i];
+            int target_id = tokens[i + 1];
+            // a BOS input starts a new document: drop the KV tensors so no
+            // earlier document can be attended to, and restart positions
+            if (token_id == BOS && i > 0) {
+                keys.clear();
+                values.clear();
+                prepare_tensors(keys, values, model.n_layer);
+                pos_id = 0;
+            }
+            vector_t x = model.embed(token_id, pos_id);
+            vector_t logits = model.gpt(x, keys, values);
             vector_t probs = model.softmax(logits);
-            value_t loss_t = probs[target_id]->log()->operator-();
-            losses.push_back(loss_t);
+            value_t log_prob = probs[target_id]->log();
+            if (graph)
+                graph->add_position(x, probs, log_prob);
+            losses.push_back(log_prob->operator-());
         }
-        value_t loss = value_from((1.f / (float)n)) * sum(losses);
+        doc_losses.push_back(value_from((1.f / (float)n)) * sum(losses));
+    }
+    return doc_losses.size() == 1 ? doc_losses[0] : value_from(1.f / (float)doc_losses.size()) * sum(doc_losses);
+}
+
+// re-fill a captured graph with the tokens of a batch of the same shape
+static void refill(Graph& graph, Model& model, const Batch& batch) {
+    size_t position = 0;
+    for (const std::vector<int>& tokens : batch.sequences) {
+        int n = std::min((size_t)model.block_size, tokens.size() - 1);
+        for (int i = 0; i < n; i++)
+            graph.set_position(position++, model.token_embedding(tokens[i]), tokens[i + 1]);
+    }
+    graph.forward();
+}
+
+// stage a copy of the training state and hand it to the background writer
+void Adam::save_checkpoint(Model& model, DataLoader& loader) {
+    Checkpoint checkpoint;
+    model.snapshot(checkpoint);
+    snapshot(checkpoint);
+    loader.snapshot(checkpoint);
+    writer->submit(std::move(checkpoint));
+    std::cout << "Queued checkpoint at step " << step << " for \"" << checkpoint_path << "\"" << std::endl;
+}
+
+void Adam::train(Model& model, DataLoader& loader, int BOS) {
+    // get params as a vector
+    vector_t parameters = model.get_all_parameters();
+
+    // initialize moment buffers (first and second moment), unless resumed
+    if (mom.empty() && vel.empty()) {
+        mom.assign(parameters.size(), 0.0);
+        vel.assign(parameters.size(), 0.0);
+    } else if (mom.size() != parameters.size() || vel.size() != parameters.size()) {
+        throw std::runtime_error("Error: optimizer has " + std::to_string(mom.size()) + " moments for " + std::to_string(parameters.size()) +
+                                 " parameters.");
+    }
+
+    // positions the graphs computed, and what full block_size windows would have
+    size_t computed_tokens = 0, padded_tokens = 0;
+
+    // one captured graph per batch shape, replayed instead of rebuilt
+    std::map<std::vector<int>, Graph> graphs;
+    size_t captures = 0, replays = 0;
+    // nodes and dependency levels of the captured graphs, their ratio is how many
+    // nodes the parallel executor can run at once on average
+    size_t captured_nodes = 0, captured_levels = 0;
+    auto start = std::chrono::steady_clock::now();
+    const int first_step = step;
+
+    // per-step wall time, split by whether the step staged a checkpoint
+    std::vector<double> step_ms, checkpoint_step_ms;
+
+    // commence training
+    std::cout << "Training with num_steps=" << num_steps << std::endl;
+    while (step < num_steps) {
+        auto step_start = std::chrono::steady_clock::now();
 
-        // finally perform backwards pass
-        loss->backward();
+        // tokenized and shuffled off the critical path by the loader thread
+        Batch batch = loader.next();
+        padded_tokens += batch.padded_tokens;
+        for (const std::vector<int>& tokens : batch.sequences)
+            computed_tokens += std::min((size_t)model.block_size, tokens.size() - 1);
+
+        std::vector<int> shape = batch_shape(batch, model.block_size, BOS);
+        auto cached = graphs.find(shape);
+        value_t loss;
+        if (cached != graphs.end()) {
+            Graph& graph = cached->second;
+            refill(graph, model, batch);
+            graph.backward();
+            loss = graph.loss();
+            replays++;
+        } else if (graphs.size() < max_graphs) {
+            Graph& graph = graphs[shape];
+            graph.capture(build_loss(model, batch, BOS, &graph));
+            captured_nodes += 2 * graph.size();
+            captured_levels += graph.forward_depth() + graph.backward_depth();
+            graph.backward();
+            loss = graph.loss();
+            captures++;
+        } else {
+            // cache is full (e.g. many distinct packing layouts), build and discard
+            loss = build_loss(model, batch, BOS, nullptr);
+            loss->backward();
+        }
 
         // Adam optimizer update: update the model parameters based on gradients
+        // every parameter is updated on its own, chunks of them run on the thread pool
         double lr_t = learning_rate * (1. - ((float)step) / ((float)num_steps));
-        for (int i = 0; i < parameters.size(); i++) {
-            mom[i] = beta1 * mom[i] + (1. - beta1) * parameters[i]->grad;
-            vel[i] = beta2 * vel[i] + (1. - beta2) * std::pow(parameters[i]->grad, 2);
-            double m_hat = mom[i] / (1. - std::pow(beta1, step + 1));
-            double v_hat = vel[i] / (1. - std::pow(beta2, step + 1));
-            double update = lr_t * m_hat / (std::pow(v_hat, .5) + eps_adam);
-            //std::cout << "updating param" << i << " by grad " << update << std::endl;
-            parameters[i]->data -= (float)update;
-            parameters[i]->grad = 0;
-        }
+        parallel_for(0, (int)parameters.size(), grain_size(64), [&](int first, int last) {
+            for (int i = first; i < last; i++) {
+                mom[i] = beta1 * mom[i] + (1. - beta1) * parameters[i]->grad;
+                vel[i] = beta2 * vel[i] + (1. - beta2) * std::pow(parameters[i]->grad, 2);
+                double m_hat = mom[i] / (1. - std::pow(beta1, step + 1));
+                double v_hat = vel[i] / (1. - std::pow(beta2, step + 1));
+                double update = lr_t * m_hat / (std::pow(v_hat, .5) + eps_adam);
+                //std::cout << "updating param" << i << " by grad " << update << std::endl;
+                parameters[i]->data -= (float)update;
+                parameters[i]->grad = 0;
+            }
+        });
 
         std::cout << "step " << std::setw(4) << step << " / " << num_steps << " | Loss " << loss->data << std::endl;
+        step++;
+
+        bool checkpointed = checkpoint_every > 0 && step % checkpoint_every == 0 && step < num_steps;
+        if (checkpointed)
+            save_checkpoint(model, loader);
+
+        std::chrono::duration<double, std::milli> step_elapsed = std::chrono::steady_clock::now() - step_start;
+        (checkpointed ? checkpoint_step_ms : step_ms).push_back(step_elapsed.count());
     }
-}
\ No newline at end of file
+    if (writer) {
+        save_checkpoint(model, loader);
+        writer->flush();
+        std::cout << "Wrote " << writer->written << " checkpoints to \"" << checkpoint_path << "\" (" << writer->superseded
+                  << " superseded before being written)" << std::endl;
+    }
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    const int steps_run = std::max(num_steps - first_step, 1);
+    std::cout << "Trained " << num_steps - first_step << " steps in " << elapsed.count() / 1000. << "s (" << elapsed.count() / steps_run
+              << " ms/step, " << captures << " graph captures, " << replays << " replays, "
+              << captured_nodes / std::max<size_t>(captured_levels, 1) << " nodes per level)" << std::endl;
+    if (!checkpoint_step_ms.empty() && !step_ms.empty()) {
+        // jitter: how much longer steps that staged a checkpoint took than regular ones
+        auto mean = [](const std::vector<double>& xs) { double total = 0.; for (double x : xs) total += x; return total / xs.size(); };
+        double regular = mean(step_ms), staged = mean(checkpoint_step_ms);
+        double variance = 0.;
+        for (double x : step_ms)
+            variance += (x - regular) * (x - regular);
+        std::cout << "Checkpoint jitter " << staged - regular << " ms (" << checkpoint_step_ms.size() << " checkpoint steps at "
+                  << staged << " ms vs. regular steps at " << regular << " ms, stddev " << std::sqrt(variance / step_ms.size())
+                  << " ms)" << std::endl;
+    }
+    if (padded_tokens > 0)
+        std::cout << "Computed " << computed_tokens << " positions, " << std::fixed << std::setprecision(1)
+                  << (double)computed_tokens / steps_run << " per step (" << (100. * computed_tokens / padded_tokens)
+                  << "% of the " << padded_tokens << " full block_size windows would compute)" << std::defaultfloat << std::endl;
+}
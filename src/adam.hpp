@@ -1,10 +1,13 @@
 #ifndef __ADAM_HPP__
 #define __ADAM_HPP__
 
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "model.hpp"
+#include "checkpoint.hpp"
+#include "data_loader.hpp"
 
 class Adam {
 private:
@@ -12,10 +15,27 @@ private:
     double beta1 = 0.85;
     double beta2 = 0.99;
     double eps_adam = 1e-8;
+    // upper bound on distinct batch shapes whose graphs are kept for replay
+    size_t max_graphs = 32;
     int num_steps;
+
+    // optimizer state: moment buffers (first and second moment) and steps taken
+    std::vector<double> mom;
+    std::vector<double> vel;
+    int step = 0;
+
+    // write a full training checkpoint every checkpoint_every steps (0 disables)
+    std::string checkpoint_path;
+    int checkpoint_every;
+    std::unique_ptr<CheckpointWriter> writer;
+    void save_checkpoint(Model& model, DataLoader& loader);
 public:
-    Adam(int num_steps = 1000);
-    void train(Model& model, std::vector<std::string> docs, int BOS);
+    Adam(int num_steps = 1000, std::string checkpoint_path = "", int checkpoint_every = 0);
+    void train(Model& model, DataLoader& loader, int BOS);
+
+    // copy optimizer state into a checkpoint, or restore it from one
+    void snapshot(Checkpoint& checkpoint) const;
+    void restore(const Checkpoint& checkpoint);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,170 @@
+#include "bench.hpp"
+#include "adam.hpp"
+#include "data_loader.hpp"
+#include "session.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <thread>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// what a child reports back through its pipe
+struct BenchResult {
+    size_t parameters;
+    double step_ms;
+    double tokens_per_second;
+    double loss;
+};
+
+// decode throughput is measured on this many docs
+static const size_t bench_docs = 2000;
+
+static BenchResult run_config(const std::vector<std::string>& docs, int vocab_size, const ModelConfig& config, int num_steps) {
+    const int BOS = vocab_size - 1;
+    Model model(vocab_size, config);
+    Adam adam(num_steps);
+    DataLoader loader(docs, BOS, model.block_size + 1);
+    auto start = std::chrono::steady_clock::now();
+    adam.train(model, loader, BOS);
+    std::chrono::duration<double, std::milli> train_elapsed = std::chrono::steady_clock::now() - start;
+
+    model.pack_weights();
+    const std::vector<std::string> eval(docs.begin(), docs.begin() + std::min(docs.size(), bench_docs));
+    size_t num_tokens = 0;
+    start = std::chrono::steady_clock::now();
+    const double loss = mean_token_loss(model, eval, BOS, &num_tokens);
+    std::chrono::duration<double> decode_elapsed = std::chrono::steady_clock::now() - start;
+    return BenchResult{model.get_all_parameters().size(), train_elapsed.count() / std::max(num_steps, 1),
+                       num_tokens / decode_elapsed.count(), loss};
+}
+
+// train num_steps steps in a child process whose thread pool has num_threads
+// threads, and write the full training state to path
+static bool train_with_threads(const std::vector<std::string>& docs, int vocab_size, const ModelConfig& config, int num_steps,
+                               int num_threads, const std::string& path) {
+    std::cout.flush();
+    const pid_t pid = fork();
+    if (pid < 0)
+        throw std::runtime_error("Error: could not fork the benchmark.");
+    if (pid == 0) {
+        const int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        int status = 1;
+        try {
+            // the pool of the process is created on first use, after this
+            setenv("MICROGPT_THREADS", std::to_string(num_threads).c_str(), 1);
+            const int BOS = vocab_size - 1;
+            Model model(vocab_size, config);
+            Adam adam(num_steps);
+            DataLoader loader(docs, BOS, model.block_size + 1);
+            adam.train(model, loader, BOS);
+            Checkpoint checkpoint;
+            model.snapshot(checkpoint);
+            adam.snapshot(checkpoint);
+            loader.snapshot(checkpoint);
+            checkpoint.write(path);
+            status = 0;
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+        }
+        std::fflush(nullptr);
+        _exit(status);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static std::string read_bytes(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// training is meant to give the same bits on any number of threads: compare
+// the checkpoints of a run on one thread and of one on several
+static void check_determinism(const std::vector<std::string>& docs, int vocab_size, const ModelConfig& config, int num_steps) {
+    const int num_threads = (int)std::max(2u, std::thread::hardware_concurrency());
+    const std::filesystem::path dir = std::filesystem::temp_directory_path();
+    const std::string prefix = "microgpt-determinism-" + std::to_string(getpid());
+    const std::string serial = (dir / (prefix + "-1.bin")).string();
+    const std::string parallel = (dir / (prefix + "-" + std::to_string(num_threads) + ".bin")).string();
+    const bool trained = train_with_threads(docs, vocab_size, config, num_steps, 1, serial) &&
+                         train_with_threads(docs, vocab_size, config, num_steps, num_threads, parallel);
+    const std::string serial_bytes = trained ? read_bytes(serial) : "";
+    const bool identical = trained && serial_bytes == read_bytes(parallel);
+    std::filesystem::remove(serial);
+    std::filesystem::remove(parallel);
+    if (!trained)
+        throw std::runtime_error("Error: training for the determinism check failed.");
+    if (!identical)
+        throw std::runtime_error("Error: " + std::to_string(num_steps) + " training steps on " + std::to_string(num_threads) +
+                                 " threads gave a different checkpoint than on 1 thread.");
+    std::cout << "Checkpoints after " << num_steps << " steps on 1 and " << num_threads << " threads are identical ("
+              << serial_bytes.size() << " bytes)" << std::endl;
+}
+
+void benchmark(const std::vector<std::string>& docs, int vocab_size, const ModelConfig& base, const std::vector<int>& widths,
+               const std::vector<int>& depths, int num_steps) {
+    std::cout << "Benchmarking " << widths.size() * depths.size() << " configurations, " << num_steps << " training steps each" << std::endl;
+    std::cout << std::setw(8) << "n_embed" << std::setw(8) << "n_head" << std::setw(8) << "n_layer" << std::setw(11) << "block_size"
+              << std::setw(11) << "params" << std::setw(11) << "ms/step" << std::setw(11) << "tok/s" << std::setw(9) << "loss"
+              << std::setw(13) << "peak RSS MB" << std::endl;
+    for (int width : widths) {
+        for (int depth : depths) {
+            ModelConfig config = base;
+            config.n_embed = width;
+            config.n_layer = depth;
+
+            int fds[2];
+            if (pipe(fds) != 0)
+                throw std::runtime_error("Error: could not create a pipe for the benchmark.");
+            std::cout.flush();
+            const pid_t pid = fork();
+            if (pid < 0)
+                throw std::runtime_error("Error: could not fork the benchmark.");
+            if (pid == 0) {
+                // the child's own logging would interleave with the table
+                close(fds[0]);
+                const int null = open("/dev/null", O_WRONLY);
+                dup2(null, STDOUT_FILENO);
+                int status = 1;
+                try {
+                    BenchResult result = run_config(docs, vocab_size, config, num_steps);
+                    status = write(fds[1], &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+                } catch (const std::exception& e) {
+                    std::cerr << e.what() << std::endl;
+                }
+                std::fflush(nullptr);
+                _exit(status);
+            }
+
+            close(fds[1]);
+            BenchResult result;
+            const bool reported = read(fds[0], &result, sizeof(result)) == sizeof(result);
+            close(fds[0]);
+            int status = 0;
+            struct rusage usage {};
+            wait4(pid, &status, 0, &usage);
+
+            std::cout << std::setw(8) << config.n_embed << std::setw(8) << config.n_head << std::setw(8) << config.n_layer
+                      << std::setw(11) << config.block_size;
+            if (!reported || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                std::cout << "  failed" << std::endl;
+                continue;
+            }
+            // ru_maxrss is in kilobytes on Linux
+            std::cout << std::setw(11) << result.parameters << std::setw(11) << std::fixed << std::setprecision(2) << result.step_ms
+                      << std::setw(11) << std::setprecision(0) << result.tokens_per_second << std::setw(9) << std::setprecision(4)
+                      << result.loss << std::setw(13) << std::setprecision(1) << usage.ru_maxrss / 1024. << std::defaultfloat << std::endl;
+        }
+    }
+    check_determinism(docs, vocab_size, base, num_steps);
+}
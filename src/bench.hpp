@@ -0,0 +1,19 @@
+#ifndef __BENCH_HPP__
+#define __BENCH_HPP__
+
+#include <string>
+#include <vector>
+
+#include "model.hpp"
+
+// `microgpt bench`: scaling sweep over every combination of widths (n_embed) and
+// depths (n_layer), the other dimensions come from base. each configuration
+// trains num_steps steps and then decodes names.txt on the inference path, in a
+// child process of its own so that its peak RSS is its own. prints one row per
+// configuration: parameters, ms per training step, decode tokens/sec, peak RSS.
+// then trains base on one thread and on several and checks that both end with
+// byte-identical checkpoints
+void benchmark(const std::vector<std::string>& docs, int vocab_size, const ModelConfig& base, const std::vector<int>& widths,
+               const std::vector<int>& depths, int num_steps);
+
+#endif
@@ -0,0 +1,236 @@
+#include "checkpoint.hpp"
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+
+// layout (all integers and floats little-endian):
+//   "MGPTCKPT" u32 version
+//   i32 vocab_size, n_embed, n_head, n_layer, block_size
+//   u32 num_tensors, then per tensor: str name, i32 rows, i32 cols, f32 data[rows * cols]
+//   str rng_state
+//   i32 step, u64 num_moments, f64 mom[num_moments], f64 vel[num_moments]
+//   u64 loader_position, u32 loader_seed, u32 loader_sampling, u64 loader_batch_size
+// where str is a u32 length followed by the raw bytes. version 1 ends after
+// loader_seed
+static_assert(std::endian::native == std::endian::little, "checkpoint format assumes a little-endian host");
+
+static const char magic[8] = {'M', 'G', 'P', 'T', 'C', 'K', 'P', 'T'};
+static const uint32_t version = 2;
+
+template <typename T>
+static void write_pod(std::ostream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+static void write_array(std::ostream& out, const std::vector<T>& values) {
+    out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+}
+
+static void write_string(std::ostream& out, const std::string& str) {
+    write_pod(out, (uint32_t)str.size());
+    out.write(str.data(), str.size());
+}
+
+template <typename T>
+static T read_pod(std::ifstream& in) {
+    T value;
+    if (!in.read(reinterpret_cast<char*>(&value), sizeof(T)))
+        throw std::runtime_error("Error: truncated checkpoint.");
+    return value;
+}
+
+// lengths come from the file, check them against the bytes it has left before
+// allocating anything that large
+static void check_remaining(std::ifstream& in, uint64_t file_size, uint64_t count, size_t item_size) {
+    const uint64_t remaining = file_size - (uint64_t)in.tellg();
+    if (count > remaining / item_size)
+        throw std::runtime_error("Error: corrupt checkpoint, a length exceeds the file size.");
+}
+
+template <typename T>
+static void read_array(std::ifstream& in, uint64_t file_size, std::vector<T>& values, uint64_t count) {
+    check_remaining(in, file_size, count, sizeof(T));
+    values.resize(count);
+    if (!in.read(reinterpret_cast<char*>(values.data()), count * sizeof(T)))
+        throw std::runtime_error("Error: truncated checkpoint.");
+}
+
+static std::string read_string(std::ifstream& in, uint64_t file_size) {
+    const uint32_t length = read_pod<uint32_t>(in);
+    check_remaining(in, file_size, length, 1);
+    std::string str(length, '\0');
+    if (!in.read(str.data(), str.size()))
+        throw std::runtime_error("Error: truncated checkpoint.");
+    return str;
+}
+
+// write to a temp file, fsync it, then atomically rename it over path and fsync
+// the directory, so a crash at any point leaves either the old or the new checkpoint
+static void write_durably(const std::string& path, const std::string& bytes) {
+    const std::string tmp_path = path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw std::runtime_error("Error: could not open checkpoint \"" + tmp_path + "\" for writing.");
+    for (size_t done = 0; done < bytes.size();) {
+        ssize_t n = ::write(fd, bytes.data() + done, bytes.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ::close(fd);
+            throw std::runtime_error("Error: failed writing checkpoint \"" + tmp_path + "\".");
+        }
+        done += n;
+    }
+    if (::fsync(fd) != 0 || ::close(fd) != 0)
+        throw std::runtime_error("Error: failed syncing checkpoint \"" + tmp_path + "\".");
+    if (::rename(tmp_path.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("Error: failed renaming checkpoint to \"" + path + "\".");
+
+    std::string dir = path.find('/') == std::string::npos ? "." : path.substr(0, path.find_last_of('/') + 1);
+    int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        ::fsync(dir_fd);
+        ::close(dir_fd);
+    }
+}
+
+void Checkpoint::write(const std::string& path) const {
+    std::ostringstream out(std::ios::binary);
+
+    out.write(magic, sizeof(magic));
+    write_pod(out, version);
+    for (int dim : {vocab_size, n_embed, n_head, n_layer, block_size})
+        write_pod(out, (int32_t)dim);
+
+    write_pod(out, (uint32_t)tensors.size());
+    for (const Tensor& tensor : tensors) {
+        write_string(out, tensor.name);
+        write_pod(out, (int32_t)tensor.rows);
+        write_pod(out, (int32_t)tensor.cols);
+        write_array(out, tensor.data);
+    }
+    write_string(out, rng_state);
+
+    write_pod(out, (int32_t)step);
+    write_pod(out, (uint64_t)mom.size());
+    write_array(out, mom);
+    write_array(out, vel);
+
+    write_pod(out, loader_position);
+    write_pod(out, (uint32_t)loader_seed);
+    write_pod(out, (uint32_t)loader_sampling);
+    write_pod(out, loader_batch_size);
+
+    write_durably(path, out.str());
+}
+
+Checkpoint Checkpoint::read(const std::string& path) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in.is_open())
+        throw std::runtime_error("Error: could not open checkpoint \"" + path + "\".");
+    const uint64_t file_size = in.tellg();
+    in.seekg(0);
+
+    char header[sizeof(magic)];
+    in.read(header, sizeof(header));
+    if (!in || !std::equal(header, header + sizeof(header), magic))
+        throw std::runtime_error("Error: \"" + path + "\" is not a checkpoint.");
+    const uint32_t file_version = read_pod<uint32_t>(in);
+    if (file_version < 1 || file_version > version)
+        throw std::runtime_error("Error: unsupported checkpoint version.");
+
+    Checkpoint checkpoint;
+    for (int* dim : {&checkpoint.vocab_size, &checkpoint.n_embed, &checkpoint.n_head, &checkpoint.n_layer, &checkpoint.block_size})
+        *dim = read_pod<int32_t>(in);
+
+    // every tensor takes at least its name length, rows and cols
+    const uint32_t num_tensors = read_pod<uint32_t>(in);
+    check_remaining(in, file_size, num_tensors, 3 * sizeof(int32_t));
+    checkpoint.tensors.resize(num_tensors);
+    for (Tensor& tensor : checkpoint.tensors) {
+        tensor.name = read_string(in, file_size);
+        tensor.rows = read_pod<int32_t>(in);
+        tensor.cols = read_pod<int32_t>(in);
+        if (tensor.rows < 0 || tensor.cols < 0)
+            throw std::runtime_error("Error: corrupt checkpoint, tensor \"" + tensor.name + "\" has negative dimensions.");
+        read_array(in, file_size, tensor.data, (uint64_t)tensor.rows * tensor.cols);
+    }
+    checkpoint.rng_state = read_string(in, file_size);
+
+    checkpoint.step = read_pod<int32_t>(in);
+    const uint64_t num_moments = read_pod<uint64_t>(in);
+    read_array(in, file_size, checkpoint.mom, num_moments);
+    read_array(in, file_size, checkpoint.vel, num_moments);
+
+    checkpoint.loader_position = read_pod<uint64_t>(in);
+    checkpoint.loader_seed = read_pod<uint32_t>(in);
+    if (file_version >= 2) {
+        checkpoint.loader_sampling = (int)read_pod<uint32_t>(in);
+        checkpoint.loader_batch_size = read_pod<uint64_t>(in);
+    }
+    return checkpoint;
+}
+
+CheckpointWriter::CheckpointWriter(std::string path) : path(std::move(path)) {
+    worker = std::thread(&CheckpointWriter::run, this);
+}
+
+CheckpointWriter::~CheckpointWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    worker.join();
+}
+
+void CheckpointWriter::submit(Checkpoint checkpoint) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (error)
+        std::rethrow_exception(error);
+    // a snapshot still waiting behind a slow write is superseded by the newer one
+    if (pending)
+        superseded++;
+    pending = std::move(checkpoint);
+    cv.notify_all();
+}
+
+void CheckpointWriter::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return (!pending && !writing) || error; });
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void CheckpointWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        cv.wait(lock, [&] { return pending || stop; });
+        // drain the last snapshot before stopping
+        if (!pending)
+            return;
+        Checkpoint checkpoint = std::move(*pending);
+        pending.reset();
+        writing = true;
+        lock.unlock();
+        std::exception_ptr failure;
+        try {
+            checkpoint.write(path);
+        } catch (...) {
+            failure = std::current_exception();
+        }
+        lock.lock();
+        writing = false;
+        if (failure)
+            error = failure;
+        else
+            written++;
+        cv.notify_all();
+    }
+}
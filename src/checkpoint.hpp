@@ -0,0 +1,86 @@
+#ifndef __CHECKPOINT_HPP__
+#define __CHECKPOINT_HPP__
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// a named weight matrix, flattened row-major
+struct Tensor {
+    std::string name;
+    int rows = 0;
+    int cols = 0;
+    std::vector<float> data;
+};
+
+// full training state: weights, optimizer moments, step counter, RNG and
+// data loader position. a snapshot is a plain copy, so it stays valid while
+// training continues, and resuming from it is bit-exact.
+struct Checkpoint {
+    // model shape
+    int vocab_size = 0;
+    int n_embed = 0;
+    int n_head = 0;
+    int n_layer = 0;
+    int block_size = 0;
+    std::vector<Tensor> tensors;
+    // serialized state of the model's sampling generator
+    std::string rng_state;
+
+    // optimizer state, moments are in get_all_parameters() order
+    int step = 0;
+    std::vector<double> mom;
+    std::vector<double> vel;
+
+    // data loader: number of batches consumed from the seeded stream, and the
+    // settings that shape the stream. version 1 files lack the settings, they
+    // read as sampling -1 and batch size 0
+    uint64_t loader_position = 0;
+    unsigned loader_seed = 0;
+    int loader_sampling = -1;
+    uint64_t loader_batch_size = 0;
+
+    // little-endian binary format, see checkpoint.cpp.
+    // written to a temp file, fsynced and atomically renamed over path
+    void write(const std::string& path) const;
+    static Checkpoint read(const std::string& path);
+};
+
+// writes checkpoint snapshots on a background thread, so the trainer only pays
+// for the staging copy. at most one snapshot waits behind the write in flight,
+// a newer submit replaces it rather than blocking the caller.
+// (io_uring is not used: write + fsync on the writer thread already keeps all
+// I/O off the training thread, and the checkpoints are tiny)
+class CheckpointWriter {
+private:
+    std::string path;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::optional<Checkpoint> pending;
+    bool writing = false;
+    bool stop = false;
+    std::exception_ptr error;
+    std::thread worker;
+
+    void run();
+public:
+    size_t written = 0;
+    size_t superseded = 0;
+
+    explicit CheckpointWriter(std::string path);
+    ~CheckpointWriter();
+    CheckpointWriter(const CheckpointWriter&) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+    // hand over a snapshot, never waits for I/O
+    void submit(Checkpoint checkpoint);
+    // wait until every submitted snapshot is durably on disk
+    void flush();
+};
+
+#endif
@@ -0,0 +1,176 @@
+#include "data_loader.hpp"
+#include <algorithm>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+static const char* sampling_name(Sampling sampling) {
+    switch (sampling) {
+    case Sampling::Packed: return "packed";
+    case Sampling::Bucketed: return "bucketed";
+    default: return "shuffled";
+    }
+}
+
+std::vector<int> tokenize(const std::string& doc, int BOS) {
+    std::vector<int> tokens;
+    tokens.reserve(doc.size() + 2);
+    tokens.push_back(BOS);
+    for (char ch : doc)
+        tokens.push_back(ch - 'a');
+    tokens.push_back(BOS);
+    return tokens;
+}
+
+std::string detokenize(const std::vector<int>& tokens) {
+    std::string doc;
+    doc.reserve(tokens.size());
+    for (int token : tokens)
+        doc.push_back((char)('a' + token));
+    return doc;
+}
+
+std::vector<int> tokenize_prompt(const std::string& prompt, int BOS) {
+    std::vector<int> tokens{BOS};
+    for (char ch : prompt) {
+        if (ch < 'a' || ch - 'a' >= BOS)
+            throw std::runtime_error("Error: prompt character '" + std::string(1, ch) + "' is not in the vocabulary.");
+        tokens.push_back(ch - 'a');
+    }
+    return tokens;
+}
+
+DataLoader::DataLoader(std::vector<std::string> docs, int BOS, int max_len, size_t batch_size, unsigned seed, size_t prefetch, Sampling sampling)
+    : docs(std::move(docs)), BOS(BOS), batch_size(batch_size), seed(seed), max_len(max_len), sampling(sampling), queue(prefetch) {
+    // an empty batch never fills a bucket and has no loss to average
+    if (batch_size < 1)
+        throw std::runtime_error("Error: batch size must be at least 1, got " + std::to_string(batch_size) + ".");
+    permutation.resize(this->docs.size());
+    shuffle_epoch();
+    std::cout << "Created data loader(batch_size=" << batch_size << ", prefetch=" << prefetch << ", seed=" << seed << ", sampling=" << sampling_name(sampling) << ")" << std::endl;
+}
+
+DataLoader::~DataLoader() {
+    stop.store(true);
+    // free up a slot in case the producer is parked on a full queue
+    Batch drained;
+    queue.try_pop(drained);
+    if (worker.joinable())
+        worker.join();
+}
+
+void DataLoader::snapshot(Checkpoint& checkpoint) const {
+    checkpoint.loader_position = consumed;
+    checkpoint.loader_seed = seed;
+    checkpoint.loader_sampling = (int)sampling;
+    checkpoint.loader_batch_size = batch_size;
+}
+
+void DataLoader::restore(const Checkpoint& checkpoint) {
+    if (checkpoint.loader_batch_size == 0)
+        throw std::runtime_error("Error: checkpoint does not record its data loader settings, it cannot be resumed bit-exactly.");
+    if (checkpoint.loader_sampling != (int)sampling || checkpoint.loader_batch_size != batch_size)
+        throw std::runtime_error("Error: checkpoint was trained with batch size " + std::to_string(checkpoint.loader_batch_size) + " and " +
+                                 sampling_name((Sampling)checkpoint.loader_sampling) + " sampling, resume it with the same flags.");
+    seed = checkpoint.loader_seed;
+    shuffle_epoch();
+    seek(checkpoint.loader_position);
+}
+
+// every epoch gets its own permutation derived from (seed, epoch), so any
+// position in the stream is reproducible from just those two numbers
+void DataLoader::shuffle_epoch() {
+    std::iota(permutation.begin(), permutation.end(), 0);
+    std::default_random_engine engine(seed + (unsigned)epoch);
+    std::shuffle(permutation.begin(), permutation.end(), engine);
+}
+
+std::vector<int> DataLoader::next_document() {
+    if (cursor == permutation.size()) {
+        epoch++;
+        cursor = 0;
+        shuffle_epoch();
+    }
+    std::vector<int> tokens = tokenize(docs[permutation[cursor++]], BOS);
+    if ((int)tokens.size() > max_len)
+        tokens.resize(max_len);
+    return tokens;
+}
+
+// concatenate whole documents into one max_len window, consecutive documents
+// share the BOS between them. a document that does not fit starts the next window.
+std::vector<int> DataLoader::pack_window() {
+    std::vector<int> window = carry.empty() ? next_document() : std::move(carry);
+    carry.clear();
+    window.reserve(max_len);
+    for (;;) {
+        std::vector<int> doc = next_document();
+        if (window.size() + doc.size() - 1 > (size_t)max_len) {
+            carry = std::move(doc);
+            return window;
+        }
+        window.insert(window.end(), doc.begin() + 1, doc.end());
+    }
+}
+
+// route documents into per-length buckets until one of them holds a full batch.
+// partially filled buckets are carried across batches and epochs.
+std::vector<std::vector<int>> DataLoader::fill_bucket() {
+    for (;;) {
+        std::vector<int> doc = next_document();
+        std::vector<std::vector<int>>& bucket = buckets[doc.size()];
+        bucket.push_back(std::move(doc));
+        if (bucket.size() == batch_size)
+            return std::move(bucket);
+    }
+}
+
+Batch DataLoader::assemble() {
+    Batch batch;
+    if (sampling == Sampling::Bucketed) {
+        batch.sequences = fill_bucket();
+        buckets.erase(batch.sequences.front().size());
+    } else {
+        batch.sequences.reserve(batch_size);
+        for (size_t i = 0; i < batch_size; i++)
+            batch.sequences.push_back(sampling == Sampling::Packed ? pack_window() : next_document());
+    }
+    // a fixed-shape window always computes max_len - 1 positions
+    batch.padded_tokens = batch.sequences.size() * (max_len - 1);
+    return batch;
+}
+
+void DataLoader::run() {
+    while (!stop.load(std::memory_order_relaxed)) {
+        Batch batch = assemble();
+        for (;;) {
+            // observe head before the stop check, so a drain in the destructor always wakes us
+            const size_t observed_head = queue.load_head();
+            if (queue.try_push(batch) || stop.load())
+                break;
+            queue.wait_not_full(observed_head);
+        }
+    }
+}
+
+void DataLoader::seek(size_t position) {
+    if (worker.joinable())
+        throw std::runtime_error("Error: cannot seek a running data loader.");
+    // regenerating the stream is cheap next to a single training step
+    for (; consumed < position; consumed++)
+        assemble();
+}
+
+Batch DataLoader::next() {
+    if (!worker.joinable())
+        worker = std::thread(&DataLoader::run, this);
+    consumed++;
+    Batch batch;
+    for (;;) {
+        const size_t observed_tail = queue.load_tail();
+        if (queue.try_pop(batch))
+            return batch;
+        queue.wait_not_empty(observed_tail);
+    }
+}
@@ -0,0 +1,139 @@
+#ifndef __DATA_LOADER_HPP__
+#define __DATA_LOADER_HPP__
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "checkpoint.hpp"
+
+// a batch of tokenized documents (BOS, chars..., BOS), ready to be fed to the model.
+// with packing, one sequence holds several documents sharing their BOS delimiters;
+// every BOS fed as input marks a document boundary (causal mask and position reset)
+struct Batch {
+    std::vector<std::vector<int>> sequences;
+    // positions a batch of full block_size windows would compute, the baseline
+    // packing and bucketing are measured against
+    size_t padded_tokens = 0;
+};
+
+// bounded single-producer single-consumer ring buffer, lock-free on both ends.
+// head is only ever written by the consumer and tail only by the producer, so
+// a full/empty check is a single acquire load of the other side's index.
+template <typename T>
+class SpscQueue {
+private:
+    std::vector<T> slots;
+    const size_t capacity;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+public:
+    explicit SpscQueue(size_t capacity) : slots(capacity), capacity(capacity) {}
+
+    bool try_push(T& item) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == capacity)
+            return false;
+        slots[t % capacity] = std::move(item);
+        tail.store(t + 1, std::memory_order_release);
+        tail.notify_one();
+        return true;
+    }
+
+    bool try_pop(T& item) {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (tail.load(std::memory_order_acquire) == h)
+            return false;
+        item = std::move(slots[h % capacity]);
+        head.store(h + 1, std::memory_order_release);
+        head.notify_one();
+        return true;
+    }
+
+    // block (futex, no spinning) until the consumer frees a slot observed as taken
+    void wait_not_full(size_t observed_head) { head.wait(observed_head, std::memory_order_acquire); }
+    // block until the producer publishes past the observed tail
+    void wait_not_empty(size_t observed_tail) { tail.wait(observed_tail, std::memory_order_acquire); }
+
+    size_t load_head() const { return head.load(std::memory_order_acquire); }
+    size_t load_tail() const { return tail.load(std::memory_order_acquire); }
+};
+
+// how documents are grouped into the sequences of a batch
+enum class Sampling {
+    // one shuffled document per sequence
+    Shuffled,
+    // several whole documents concatenated into each block_size window
+    Packed,
+    // one document per sequence, all sequences of a batch share the same length
+    Bucketed,
+};
+
+// tokenizer: translate a document to discrete symbols, delimited by BOS on both ends
+std::vector<int> tokenize(const std::string& doc, int BOS);
+// and back, for sampled tokens without BOS
+std::string detokenize(const std::vector<int>& tokens);
+// a prompt to complete: BOS followed by its chars, which must all be in the vocabulary
+std::vector<int> tokenize_prompt(const std::string& prompt, int BOS);
+
+// background data loader: shuffles docs with a seeded permutation per epoch,
+// tokenizes and assembles batches on its own thread and hands them over
+// through a bounded queue (double-buffered by default). the batch stream is a
+// pure function of (docs, seed, sampling, batch_size), so a position in it is
+// just the number of batches consumed. the thread starts on the first next().
+class DataLoader {
+private:
+    std::vector<std::string> docs;
+    int BOS;
+    size_t batch_size;
+    unsigned seed;
+    int max_len;
+    Sampling sampling;
+
+    // producer-side position inside the epoch permutation
+    std::vector<size_t> permutation;
+    size_t epoch = 0;
+    size_t cursor = 0;
+    // document that did not fit into the previous packed window
+    std::vector<int> carry;
+    // documents waiting for their length bucket to fill up
+    std::map<size_t, std::vector<std::vector<int>>> buckets;
+
+    // consumer-side position: batches handed out by next(), including skipped ones
+    size_t consumed = 0;
+
+    SpscQueue<Batch> queue;
+    std::atomic<bool> stop{false};
+    std::thread worker;
+
+    void shuffle_epoch();
+    std::vector<int> next_document();
+    std::vector<int> pack_window();
+    std::vector<std::vector<int>> fill_bucket();
+    Batch assemble();
+    void run();
+public:
+    DataLoader(std::vector<std::string> docs, int BOS, int max_len, size_t batch_size = 1, unsigned seed = 42, size_t prefetch = 2, Sampling sampling = Sampling::Shuffled);
+    ~DataLoader();
+    DataLoader(const DataLoader&) = delete;
+    DataLoader& operator=(const DataLoader&) = delete;
+
+    // pop the next ready batch, only blocks if the producer fell behind
+    Batch next();
+
+    // skip ahead to a batch position of the stream, must be called before the first next()
+    void seek(size_t position);
+    size_t position() const { return consumed; }
+    unsigned get_seed() const { return seed; }
+
+    // record the stream position and the settings that shape the stream
+    void snapshot(Checkpoint& checkpoint) const;
+    // continue the stream of a checkpoint, which must have been trained with the
+    // same sampling and batch size. must be called before the first next()
+    void restore(const Checkpoint& checkpoint);
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef __GENERATOR_HPP__
+#define __GENERATOR_HPP__
+
+#include <coroutine>
+#include <exception>
+#include <iterator>
+#include <utility>
+
+// lazy C++20 coroutine generator, a minimal std::generator: the body runs only
+// while the consumer asks for the next value and is suspended at every co_yield.
+// it does not belong to a thread, whoever calls next() resumes it.
+template <typename T>
+class Generator {
+public:
+    struct promise_type {
+        T value;
+        std::exception_ptr error;
+
+        Generator get_return_object() { return Generator(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(T yielded) {
+            value = std::move(yielded);
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    class iterator {
+    private:
+        Generator* generator;
+    public:
+        explicit iterator(Generator* generator) : generator(generator) {}
+        const T& operator*() const { return generator->value(); }
+        iterator& operator++() {
+            if (!generator->next())
+                generator = nullptr;
+            return *this;
+        }
+        bool operator==(std::default_sentinel_t) const { return generator == nullptr; }
+    };
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Generator(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+public:
+    Generator(Generator&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Generator& operator=(Generator&& other) noexcept {
+        if (this != &other) {
+            if (handle)
+                handle.destroy();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+    Generator(const Generator&) = delete;
+    Generator& operator=(const Generator&) = delete;
+    ~Generator() {
+        if (handle)
+            handle.destroy();
+    }
+
+    // run the body up to its next co_yield, false once it returned.
+    // exceptions thrown by the body surface here
+    bool next() {
+        if (!handle || handle.done())
+            return false;
+        handle.resume();
+        if (handle.promise().error)
+            std::rethrow_exception(std::exchange(handle.promise().error, nullptr));
+        return !handle.done();
+    }
+    // the value of the last successful next()
+    const T& value() const { return handle.promise().value; }
+
+    iterator begin() {
+        iterator it(this);
+        return ++it;
+    }
+    std::default_sentinel_t end() { return {}; }
+};
+
+#endif
@@ -0,0 +1,167 @@
+#include "graph.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cassert>
+#include <unordered_map>
+#include <unordered_set>
+
+// edges of a target node: valid only while it points at this probability
+static const uint32_t RETARGETED = 1u << 31;
+
+void Graph::add_position(const vector_t& embedding, const vector_t& probs, const value_t& target) {
+    embeddings.push_back(embedding);
+    probabilities.push_back(probs);
+    targets.push_back(target);
+}
+
+void Graph::capture(value_t root) {
+    std::unordered_set<Value*> visited;
+    // every softmax output may become a target on replay, so all of them have to
+    // be recomputed even if the captured targets did not reach them from root
+    for (const vector_t& probs : probabilities)
+        for (const value_t& prob : probs)
+            prob->build_topology(prob, topology, visited);
+    this->root = std::move(root);
+    this->root->build_topology(this->root, topology, visited);
+    schedule();
+}
+
+// sort node indices by level, keeping topological order within a level
+static void group(const std::vector<uint32_t>& level, std::vector<uint32_t>& order, std::vector<uint32_t>& levels) {
+    const uint32_t depth = level.empty() ? 0 : *std::max_element(level.begin(), level.end()) + 1;
+    levels.assign(depth + 1, 0);
+    for (uint32_t l : level)
+        levels[l + 1]++;
+    for (uint32_t l = 0; l < depth; l++)
+        levels[l + 1] += levels[l];
+    std::vector<uint32_t> fill(levels.begin(), levels.end() - 1);
+    order.resize(level.size());
+    for (uint32_t t = 0; t < level.size(); t++)
+        order[fill[level[t]]++] = t;
+}
+
+void Graph::schedule() {
+    const uint32_t n = topology.size();
+    std::unordered_map<const Value*, uint32_t> index;
+    index.reserve(n);
+    for (uint32_t t = 0; t < n; t++)
+        index[topology[t].get()] = t;
+
+    // the slots re-pointed on replay: a target may pick any probability of its
+    // position, and token embeddings are not part of the topology at all
+    std::unordered_map<uint32_t, uint32_t> target_position;
+    for (uint32_t position = 0; position < targets.size(); position++)
+        target_position[index.at(targets[position].get())] = position;
+    std::vector<bool> embedding(n, false);
+    for (const vector_t& position : embeddings)
+        for (const value_t& node : position)
+            embedding[index.at(node.get())] = true;
+    embedding_nodes.clear();
+    for (uint32_t t = n; t-- > 0;)
+        if (embedding[t])
+            embedding_nodes.push_back(t);
+
+    // children of every node as topology indices, all candidates for a target
+    std::vector<uint32_t> child_offsets(n + 1, 0), children;
+    for (uint32_t t = 0; t < n; t++) {
+        const Value* node = topology[t].get();
+        auto target = target_position.find(t);
+        if (target != target_position.end()) {
+            for (const value_t& prob : probabilities[target->second])
+                children.push_back(index.at(prob.get()));
+        } else {
+            for (size_t slot = embedding[t] ? 1 : 0; slot < node->children.size(); slot++)
+                children.push_back(index.at(node->children[slot].get()));
+        }
+        child_offsets[t + 1] = children.size();
+    }
+
+    // forward level: one past the deepest child, leaves at 0
+    std::vector<uint32_t> level(n, 0);
+    for (uint32_t t = 0; t < n; t++)
+        for (uint32_t i = child_offsets[t]; i < child_offsets[t + 1]; i++)
+            level[t] = std::max(level[t], level[children[i]] + 1);
+    group(level, forward_order, forward_levels);
+
+    // backward level: one past the deepest parent, parents come later in topological order
+    level.assign(n, 0);
+    for (uint32_t t = n; t-- > 0;)
+        for (uint32_t i = child_offsets[t]; i < child_offsets[t + 1]; i++)
+            level[children[i]] = std::max(level[children[i]], level[t] + 1);
+    group(level, backward_order, backward_levels);
+
+    // uses of every node in the order the serial backward adds them: parents
+    // from last to first in topological order, slots in order
+    edge_offsets.assign(n + 1, 0);
+    for (uint32_t child : children)
+        edge_offsets[child + 1]++;
+    for (uint32_t t = 0; t < n; t++)
+        edge_offsets[t + 1] += edge_offsets[t];
+    std::vector<uint32_t> fill(edge_offsets.begin(), edge_offsets.end() - 1);
+    edges.resize(children.size());
+    for (uint32_t t = n; t-- > 0;) {
+        const bool target = target_position.count(t);
+        const uint32_t first_slot = embedding[t] ? 1 : 0;
+        for (uint32_t i = child_offsets[t]; i < child_offsets[t + 1]; i++)
+            edges[fill[children[i]]++] = Edge{t, target ? RETARGETED : first_slot + i - child_offsets[t]};
+    }
+    grain = grain_size(children.size() / std::max(n, 1u) + 1, 1 << 12);
+}
+
+void Graph::set_position(size_t position, const vector_t& token_embedding, int target_id) {
+    // embedding nodes are (wte[token][i] + wpe[pos][i]), positions are baked in
+    const vector_t& embedding = embeddings[position];
+    assert(embedding.size() == token_embedding.size());
+    for (size_t i = 0; i < embedding.size(); i++)
+        embedding[i]->children[0] = token_embedding[i];
+    // target nodes are log(probs[target])
+    targets[position]->children[0] = probabilities[position][target_id];
+}
+
+void Graph::forward() {
+    if (ThreadPool::global().size() == 1) {
+        for (const value_t& node : topology)
+            node->forward();
+        return;
+    }
+    // a node only reads its children, which are all in earlier levels
+    for (size_t l = 0; l + 1 < forward_levels.size(); l++)
+        parallel_for(forward_levels[l], forward_levels[l + 1], grain, [&](int first, int last) {
+            for (int i = first; i < last; i++)
+                topology[forward_order[i]]->forward();
+        });
+}
+
+void Graph::backward() {
+    if (ThreadPool::global().size() == 1) {
+        root->backward(topology);
+        return;
+    }
+    root->grad = 1.f;
+    // level 0 has no parents, every later node sums what its parents pass down
+    for (size_t l = 1; l + 1 < backward_levels.size(); l++)
+        parallel_for(backward_levels[l], backward_levels[l + 1], grain, [&](int first, int last) {
+            for (int i = first; i < last; i++) {
+                const uint32_t t = backward_order[i];
+                Value* node = topology[t].get();
+                float grad = node->grad;
+                for (uint32_t e = edge_offsets[t]; e < edge_offsets[t + 1]; e++) {
+                    const Value* parent = topology[edges[e].parent].get();
+                    uint32_t slot = edges[e].slot;
+                    if (slot == RETARGETED) {
+                        if (parent->children[0].get() != node)
+                            continue;
+                        slot = 0;
+                    }
+                    grad += parent->grad * parent->local_grads[slot];
+                }
+                node->grad = grad;
+            }
+        });
+    // token embeddings are only used by the embedding nodes, which pass them
+    // their gradient last to first as in the serial backward
+    for (uint32_t t : embedding_nodes) {
+        Value* node = topology[t].get();
+        node->children[0]->grad += node->grad * node->local_grads[0];
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef __GRAPH_HPP__
+#define __GRAPH_HPP__
+
+#include <cstdint>
+#include <vector>
+
+#include "value.hpp"
+
+class Model;
+
+// a captured training graph that can be re-filled with new token ids and
+// replayed without allocating a single node (think CUDA graph capture, but
+// for our scalar autograd). only the shape of a batch is baked in, i.e. the
+// number of sequences, their lengths and document boundaries, while token
+// embeddings and loss targets are input slots re-pointed on every replay.
+//
+// replays run on the thread pool level by level: a forward level holds the
+// nodes whose children are all in earlier levels, a backward level the nodes
+// whose parents are. the nodes of one level (e.g. the dots of all rows and
+// heads of a batch) are independent and computed in parallel. in the backward
+// every node pulls its gradient from its parents instead of having them push
+// into it, so no two threads ever write the same node, and the contributions
+// are summed in the order of the serial backward: the result is the same bits
+// for any number of threads.
+class Graph {
+private:
+    value_t root;
+    vector_t topology;
+
+    // a use of a node as child slot of the parent at topology[parent]
+    struct Edge {
+        uint32_t parent;
+        uint32_t slot;
+    };
+    // node indices grouped by level, level l is [levels[l], levels[l + 1])
+    std::vector<uint32_t> forward_order, forward_levels;
+    std::vector<uint32_t> backward_order, backward_levels;
+    // uses of every node, node t's are [edges[t], edges[t + 1]) in serial backward order
+    std::vector<uint32_t> edge_offsets;
+    std::vector<Edge> edges;
+    // embedding nodes from last to first, they pass the token embeddings their gradient
+    std::vector<uint32_t> embedding_nodes;
+    // nodes per task, so that a task has enough edges to be worth it
+    int grain = 1;
+
+    void schedule();
+
+    // input slots per position, in the order they were recorded
+    std::vector<vector_t> embeddings;
+    std::vector<vector_t> probabilities;
+    vector_t targets;
+public:
+    // record the slots of one position while building the graph:
+    // the token + position embedding add nodes, the softmax outputs and the
+    // log node that picks the target probability
+    void add_position(const vector_t& embedding, const vector_t& probs, const value_t& target);
+
+    // freeze the topology below root, must follow all add_position calls
+    void capture(value_t root);
+
+    // re-point input slots for one position, in recording order
+    void set_position(size_t position, const vector_t& token_embedding, int target_id);
+
+    // recompute every node in topological order, resets intermediate grads
+    void forward();
+    void backward();
+    // number of dependency levels of the forward and the backward
+    size_t forward_depth() const { return forward_levels.size() - 1; }
+    size_t backward_depth() const { return backward_levels.size() - 1; }
+
+    const value_t& loss() const { return root; }
+    size_t size() const { return topology.size(); }
+};
+
+#endif
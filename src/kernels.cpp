@@ -0,0 +1,156 @@
+#include "kernels.hpp"
+#include "model.hpp"
+#include "thread_pool.hpp"
+#include <cmath>
+
+// every kernel is written once against sizes that are either compile-time
+// constants (> 0) or 0, in which case the runtime size is used. the
+// arithmetic is the same in both cases, only the bounds are known earlier
+
+// every weight row is streamed from memory once and reused for the whole
+// batch (matvec for a batch of one). large matrices split their rows across
+// the thread pool, every row is still summed in the same order
+template <int COLS>
+static void matmul_fixed(const WeightView& w, const float* x, float* y, int batch) {
+    const int cols = COLS ? COLS : w.cols;
+    parallel_for(0, w.rows, grain_size((size_t)cols * batch), [&](int first, int last) {
+        for (int r = first; r < last; r++) {
+            const float* row = w.row(r);
+            for (int b = 0; b < batch; b++) {
+                const float* xb = x + (size_t)b * cols;
+                float acc = 0.f;
+                for (int c = 0; c < cols; c++)
+                    acc += row[c] * xb[c];
+                y[(size_t)b * w.rows + r] = acc;
+            }
+        }
+    });
+}
+
+// the linear layers of a model only come in two widths: n_embed and 4 * n_embed
+template <int N_EMBED>
+static void matmul(const WeightView& w, const float* x, float* y, int batch) {
+    if (N_EMBED && w.cols == N_EMBED)
+        matmul_fixed<N_EMBED>(w, x, y, batch);
+    else if (N_EMBED && w.cols == 4 * N_EMBED)
+        matmul_fixed<4 * N_EMBED>(w, x, y, batch);
+    else
+        matmul_fixed<0>(w, x, y, batch);
+}
+
+template <int N_EMBED>
+static void rms_norm(float* x, int batch, int n_embed) {
+    const int n = N_EMBED ? N_EMBED : n_embed;
+    for (int b = 0; b < batch; b++) {
+        float* xb = x + (size_t)b * n;
+        float mean_square = 0.f;
+        for (int i = 0; i < n; i++)
+            mean_square += xb[i] * xb[i];
+        mean_square = mean_square * std::pow((float)n, -1.f);
+        const float scale = std::pow(mean_square + 1e-5f, -.5f);
+        for (int i = 0; i < n; i++)
+            xb[i] = xb[i] * scale;
+    }
+}
+
+// walks the page table, positions [first, first + page_size) share a page
+template <int N_EMBED, int N_HEAD, int BLOCK_SIZE>
+static void attend_head(const KVCache& cache, int li, int h, const float* q, int seq_len, float* scores, float* out) {
+    const int n_embed = N_EMBED ? N_EMBED : cache.n_embed();
+    const int n_head = N_HEAD ? N_HEAD : cache.n_head();
+    const int head_dim = n_embed / n_head;
+    const int hs = h * head_dim;
+    const int page_size = cache.page_size();
+    const float inv_sqrt_d = 1.f / std::sqrt((float)head_dim);
+    // scores live on the stack when the longest sequence is known
+    float local[BLOCK_SIZE ? BLOCK_SIZE : 1];
+    if (BLOCK_SIZE)
+        scores = local;
+
+    if (!cache.quantized()) {
+        for (int p = 0, first = 0; first < seq_len; p++, first += page_size) {
+            const float* page = cache.page(p);
+            for (int slot = 0; slot < page_size && first + slot < seq_len; slot++) {
+                const float* k_t = page + cache.offset(li, 0, slot, n_embed) + hs;
+                float score = 0.f;
+                for (int j = 0; j < head_dim; j++)
+                    score += q[hs + j] * k_t[j];
+                scores[first + slot] = score * inv_sqrt_d;
+            }
+        }
+        softmax_inplace(scores, seq_len);
+
+        // weighted sum over value vectors
+        for (int j = 0; j < head_dim; j++) {
+            float head_out = 0.f;
+            for (int p = 0, first = 0; first < seq_len; p++, first += page_size) {
+                const float* page = cache.page(p);
+                for (int slot = 0; slot < page_size && first + slot < seq_len; slot++)
+                    head_out = head_out + scores[first + slot] * page[cache.offset(li, 1, slot, n_embed) + hs + j];
+            }
+            out[hs + j] = head_out;
+        }
+        return;
+    }
+
+    // int8: the dot runs on the stored bytes and the head's scale is applied
+    // once per position, for the values it is folded into the attention weight
+    for (int p = 0, first = 0; first < seq_len; p++, first += page_size) {
+        const float* page = cache.page(p);
+        const int8_t* rows = cache.quantized_rows(page);
+        for (int slot = 0; slot < page_size && first + slot < seq_len; slot++) {
+            const int8_t* k_t = rows + cache.offset(li, 0, slot, n_embed) + hs;
+            float score = 0.f;
+            for (int j = 0; j < head_dim; j++)
+                score += q[hs + j] * k_t[j];
+            scores[first + slot] = score * page[cache.offset(li, 0, slot, n_head) + h] * inv_sqrt_d;
+        }
+    }
+    softmax_inplace(scores, seq_len);
+    for (int j = 0; j < head_dim; j++)
+        out[hs + j] = 0.f;
+    for (int p = 0, first = 0; first < seq_len; p++, first += page_size) {
+        const float* page = cache.page(p);
+        const int8_t* rows = cache.quantized_rows(page);
+        for (int slot = 0; slot < page_size && first + slot < seq_len; slot++) {
+            const float weight = scores[first + slot] * page[cache.offset(li, 1, slot, n_head) + h];
+            const int8_t* v_t = rows + cache.offset(li, 1, slot, n_embed) + hs;
+            for (int j = 0; j < head_dim; j++)
+                out[hs + j] += weight * v_t[j];
+        }
+    }
+}
+
+template <int N_EMBED, int N_HEAD, int BLOCK_SIZE>
+static void attend_row(const KVCache& cache, int li, const float* q, int seq_len, float* scores, float* out) {
+    const int n_head = N_HEAD ? N_HEAD : cache.n_head();
+    for (int h = 0; h < n_head; h++)
+        attend_head<N_EMBED, N_HEAD, BLOCK_SIZE>(cache, li, h, q, seq_len, scores, out);
+}
+
+template <int N_EMBED, int N_HEAD, int BLOCK_SIZE>
+static constexpr ShapeKernels specialize(const char* name) {
+    return ShapeKernels{name, matmul<N_EMBED>, rms_norm<N_EMBED>, attend_head<N_EMBED, N_HEAD, BLOCK_SIZE>,
+                        attend_row<N_EMBED, N_HEAD, BLOCK_SIZE>};
+}
+
+struct Specialization {
+    int n_embed, n_head, block_size;
+    ShapeKernels kernels;
+};
+
+// shapes compiled in, add a line here for a new common configuration
+static const Specialization specializations[] = {
+    {16, 4, 16, specialize<16, 4, 16>("16x4x16")},
+    {32, 4, 32, specialize<32, 4, 32>("32x4x32")},
+    {64, 8, 64, specialize<64, 8, 64>("64x8x64")},
+};
+
+static const ShapeKernels generic = specialize<0, 0, 0>("generic");
+
+const ShapeKernels& shape_kernels(int n_embed, int n_head, int block_size) {
+    for (const Specialization& s : specializations)
+        if (s.n_embed == n_embed && s.n_head == n_head && s.block_size == block_size)
+            return s.kernels;
+    return generic;
+}
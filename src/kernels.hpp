@@ -0,0 +1,28 @@
+#ifndef __KERNELS_HPP__
+#define __KERNELS_HPP__
+
+#include "kv_cache.hpp"
+#include "weights.hpp"
+
+// inner loops of the no-grad f32 inference path for one model shape. common
+// shapes get versions compiled with their sizes as constants: fixed trip counts,
+// unrolled head loops and scores on the stack. any other shape gets the same
+// code with runtime bounds. both produce the same numbers
+struct ShapeKernels {
+    // "n_embed x n_head x block_size" of the specialization, or "generic"
+    const char* name;
+    // y[b * rows + r] = w.row(r) . x[b * cols]
+    void (*matmul)(const WeightView& w, const float* x, float* y, int batch);
+    // root-mean-square norm of batch rows of n_embed, in place
+    void (*rms_norm)(float* x, int batch, int n_embed);
+    // attention of one row against positions [0, seq_len) of layer li: scores,
+    // softmax and weighted sum of the values into out, for head h or all heads.
+    // scores needs seq_len floats and is only used by the generic version
+    void (*attend_head)(const KVCache& cache, int li, int h, const float* q, int seq_len, float* scores, float* out);
+    void (*attend_row)(const KVCache& cache, int li, const float* q, int seq_len, float* scores, float* out);
+};
+
+// the specialization for this shape if there is one, the generic kernels otherwise
+const ShapeKernels& shape_kernels(int n_embed, int n_head, int block_size);
+
+#endif
@@ -0,0 +1,141 @@
+#include "kv_cache.hpp"
+#include "quant.hpp"
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+// pages are allocated this many at a time
+static const int pages_per_chunk = 64;
+
+KVPagePool::KVPagePool(int n_layer, int n_embed, int n_head, bool quantized, int page_size)
+    : n_layer(n_layer), n_embed(n_embed), n_head(n_head), page_size(page_size), quantized(quantized) {
+    const size_t rows = (size_t)n_layer * 2 * page_size;
+    page_floats = quantized ? rows * n_head + (rows * n_embed + sizeof(float) - 1) / sizeof(float) : rows * n_embed;
+}
+
+KVPage* KVPagePool::allocate() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (free_pages.empty()) {
+        chunks.emplace_back(new float[page_floats * pages_per_chunk]);
+        page_chunks.emplace_back(new KVPage[pages_per_chunk]);
+        // every page can be free at once, releasing never reallocates
+        free_pages.reserve(chunks.size() * pages_per_chunk);
+        for (int i = pages_per_chunk - 1; i >= 0; i--) {
+            page_chunks.back()[i].data = chunks.back().get() + (size_t)i * page_floats;
+            free_pages.push_back(&page_chunks.back()[i]);
+        }
+    }
+    KVPage* page = free_pages.back();
+    free_pages.pop_back();
+    page->refs.store(1, std::memory_order_relaxed);
+    peak = std::max(peak, ++in_use);
+    return page;
+}
+
+void KVPagePool::release(KVPage* page) {
+    if (page->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    std::lock_guard<std::mutex> lock(mutex);
+    free_pages.push_back(page);
+    in_use--;
+}
+
+KVPage* KVPagePool::copy(KVPage* page) {
+    KVPage* page_copy = allocate();
+    std::memcpy(page_copy->data, page->data, page_bytes());
+    release(page);
+    copies.fetch_add(1, std::memory_order_relaxed);
+    return page_copy;
+}
+
+KVPoolStats KVPagePool::stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return KVPoolStats{page_bytes(), chunks.size() * pages_per_chunk, in_use, peak, copies.load()};
+}
+
+KVCache::KVCache(std::shared_ptr<KVPagePool> pool) : pool(std::move(pool)) {}
+
+KVCache::KVCache(KVCache&& other) noexcept
+    : pool(std::move(other.pool)), pages(std::move(other.pages)), length(std::exchange(other.length, 0)) {}
+
+KVCache& KVCache::operator=(KVCache&& other) noexcept {
+    if (this != &other) {
+        clear();
+        pool = std::move(other.pool);
+        pages = std::move(other.pages);
+        length = std::exchange(other.length, 0);
+    }
+    return *this;
+}
+
+KVCache KVCache::fork() const {
+    KVCache cache(pool);
+    cache.pages = pages;
+    for (KVPage* page : cache.pages)
+        pool->retain(page);
+    cache.length = length;
+    return cache;
+}
+
+void KVCache::clear() {
+    for (KVPage* page : pages)
+        pool->release(page);
+    pages.clear();
+    length = 0;
+}
+
+void KVCache::grow(int positions) {
+    const size_t needed = (positions + pool->page_size - 1) / pool->page_size;
+    while (pages.size() < needed)
+        pages.push_back(pool->allocate());
+}
+
+void KVCache::reserve(int positions) {
+    pages.reserve((positions + pool->page_size - 1) / pool->page_size);
+}
+
+float* KVCache::writable(int pos) {
+    KVPage*& page = pages[pos / pool->page_size];
+    if (page->refs.load(std::memory_order_acquire) > 1)
+        page = pool->copy(page);
+    return page->data;
+}
+
+void KVCache::store(int li, int pos, const float* k, const float* v) {
+    const int n_embed = pool->n_embed;
+    const int slot = pos % pool->page_size;
+    float* data = writable(pos);
+    if (!pool->quantized) {
+        std::copy_n(k, n_embed, data + offset(li, 0, slot, n_embed));
+        std::copy_n(v, n_embed, data + offset(li, 1, slot, n_embed));
+        return;
+    }
+    const int n_head = pool->n_head;
+    const int head_dim = n_embed / n_head;
+    int8_t* rows = const_cast<int8_t*>(quantized_rows(data));
+    float* k_scales = data + offset(li, 0, slot, n_head);
+    float* v_scales = data + offset(li, 1, slot, n_head);
+    for (int h = 0; h < n_head; h++) {
+        const int hs = h * head_dim;
+        k_scales[h] = quantize_row(k + hs, head_dim, rows + offset(li, 0, slot, n_embed) + hs);
+        v_scales[h] = quantize_row(v + hs, head_dim, rows + offset(li, 1, slot, n_embed) + hs);
+    }
+}
+
+void KVCache::store_quantized(int li, int pos, const int8_t* k, const int8_t* v, const float* k_scales, const float* v_scales) {
+    const int n_embed = pool->n_embed;
+    const int n_head = pool->n_head;
+    const int slot = pos % pool->page_size;
+    float* data = writable(pos);
+    int8_t* rows = const_cast<int8_t*>(quantized_rows(data));
+    std::copy_n(k, n_embed, rows + offset(li, 0, slot, n_embed));
+    std::copy_n(v, n_embed, rows + offset(li, 1, slot, n_embed));
+    std::copy_n(k_scales, n_head, data + offset(li, 0, slot, n_head));
+    std::copy_n(v_scales, n_head, data + offset(li, 1, slot, n_head));
+}
+
+size_t KVCache::bytes_per_position() const {
+    const size_t per_layer = pool->quantized ? 2 * (pool->n_embed * sizeof(int8_t) + pool->n_head * sizeof(float))
+                                             : 2 * pool->n_embed * sizeof(float);
+    return per_layer * pool->n_layer;
+}
@@ -0,0 +1,121 @@
+#ifndef __KV_CACHE_HPP__
+#define __KV_CACHE_HPP__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// page_size positions of keys and values for every layer, shared by all
+// caches it was forked into and copied before any of them writes to it
+struct KVPage {
+    std::atomic<int> refs{0};
+    float* data = nullptr;
+};
+
+struct KVPoolStats {
+    size_t page_bytes = 0;
+    size_t pages = 0;
+    size_t in_use = 0;
+    size_t peak = 0;
+    // shared pages copied before a write
+    uint64_t copies = 0;
+};
+
+// fixed-size KV pages for every sequence of a model. pages are handed out from
+// a free list and carved from chunks that never move, so a page stays where it
+// is while other threads allocate. released pages go back to the free list.
+//
+// f32 page: [layer][key|value][slot][n_embed] floats
+// int8 page: scales [layer][key|value][slot][n_head] floats, then
+//            [layer][key|value][slot][n_embed] bytes
+class KVPagePool {
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<float[]>> chunks;
+    std::vector<std::unique_ptr<KVPage[]>> page_chunks;
+    std::vector<KVPage*> free_pages;
+    size_t in_use = 0;
+    size_t peak = 0;
+    std::atomic<uint64_t> copies{0};
+    size_t page_floats;
+public:
+    const int n_layer;
+    const int n_embed;
+    const int n_head;
+    const int page_size;
+    const bool quantized;
+
+    KVPagePool(int n_layer, int n_embed, int n_head, bool quantized, int page_size = 4);
+    KVPagePool(const KVPagePool&) = delete;
+    KVPagePool& operator=(const KVPagePool&) = delete;
+
+    // a page with one reference, contents undefined
+    KVPage* allocate();
+    void retain(KVPage* page) { page->refs.fetch_add(1, std::memory_order_relaxed); }
+    void release(KVPage* page);
+    // private copy of a shared page, drops the reference to the original
+    KVPage* copy(KVPage* page);
+    size_t page_bytes() const { return page_floats * sizeof(float); }
+    KVPoolStats stats();
+};
+
+// keys and values of one sequence, for the no-grad inference path: a page table
+// into a shared pool, so a sequence holds memory for the positions it used, not
+// for block_size. either f32, or int8 with one scale per head and position that
+// attention expands on the fly while it reads the cache. fork() shares every page
+// with the new cache, a page is copied the first time one of them writes to it
+class KVCache {
+private:
+    std::shared_ptr<KVPagePool> pool;
+    std::vector<KVPage*> pages;
+
+    // page holding position pos, made private to this cache
+    float* writable(int pos);
+public:
+    int length = 0;
+
+    KVCache() = default;
+    explicit KVCache(std::shared_ptr<KVPagePool> pool);
+    KVCache(KVCache&& other) noexcept;
+    KVCache& operator=(KVCache&& other) noexcept;
+    KVCache(const KVCache&) = delete;
+    KVCache& operator=(const KVCache&) = delete;
+    ~KVCache() { clear(); }
+
+    // a cache sharing every page of this one
+    KVCache fork() const;
+    // forget all positions, their pages go back to the pool
+    void clear();
+    // make room for positions [0, positions), and reserve the page table ahead
+    void grow(int positions);
+    void reserve(int positions);
+    // copy the page of position pos now if it is shared, so that no store to it
+    // copies it later, e.g. stores of different layers running on different threads
+    void unshare(int pos) { writable(pos); }
+    // write the key and value rows of position pos in layer li, quantized for int8 caches
+    void store(int li, int pos, const float* k, const float* v);
+    // write already quantized rows and their head scales into an int8 cache
+    void store_quantized(int li, int pos, const int8_t* k, const int8_t* v, const float* k_scales, const float* v_scales);
+
+    bool quantized() const { return pool->quantized; }
+    int n_embed() const { return pool->n_embed; }
+    int n_head() const { return pool->n_head; }
+    int page_size() const { return pool->page_size; }
+    size_t num_pages() const { return pages.size(); }
+    // bytes one position takes across all layers
+    size_t bytes_per_position() const;
+
+    // offset of the key (kv = 0) or value (kv = 1) row of a slot in layer li, in
+    // elements of width: n_embed for f32 and int8 rows, n_head for scales
+    size_t offset(int li, int kv, int slot, int width) const { return ((size_t)(2 * li + kv) * pool->page_size + slot) * width; }
+    const float* page(int p) const { return pages[p]->data; }
+    // where the int8 rows of a page start, after its scales
+    const int8_t* quantized_rows(const float* page) const {
+        return reinterpret_cast<const int8_t*>(page + (size_t)pool->n_layer * 2 * pool->page_size * pool->n_head);
+    }
+};
+
+#endif
@@ -0,0 +1,169 @@
+#include "libmicrogpt.h"
+#include "checkpoint.hpp"
+#include "model.hpp"
+#include "prefix_cache.hpp"
+#include "session.hpp"
+#include "weights.hpp"
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+struct mgpt_model {
+    std::unique_ptr<Model> model;
+    std::unique_ptr<PrefixCache> prefix_cache;
+    // live sessions, the precision is fixed while there are any. the mutex
+    // orders precision changes against sessions being created and freed
+    std::mutex mutex;
+    int sessions = 0;
+};
+
+struct mgpt_session {
+    mgpt_model* model;
+    InferenceSession session;
+};
+
+static thread_local std::string last_error;
+
+// run f, turning any exception into a failure value plus a message
+template <typename F, typename R>
+static R guarded(F f, R failure) {
+    try {
+        return f();
+    } catch (const std::exception& e) {
+        last_error = e.what();
+    } catch (...) {
+        last_error = "Error: unknown failure.";
+    }
+    return failure;
+}
+
+static bool is_weight_file(const char* path) {
+    char magic[8] = {};
+    std::ifstream file(path, std::ios::binary);
+    file.read(magic, sizeof(magic));
+    return std::memcmp(magic, "MGPTWGHT", sizeof(magic)) == 0;
+}
+
+mgpt_model* mgpt_load(const char* path) {
+    return guarded([path]() -> mgpt_model* {
+        auto handle = std::make_unique<mgpt_model>();
+        if (is_weight_file(path)) {
+            handle->model = std::make_unique<Model>(std::make_shared<WeightFile>(path));
+        } else {
+            Checkpoint checkpoint = Checkpoint::read(path);
+            handle->model = std::make_unique<Model>(checkpoint.vocab_size, ModelConfig::of(checkpoint));
+            handle->model->restore(checkpoint);
+            handle->model->pack_weights();
+        }
+        handle->prefix_cache = std::make_unique<PrefixCache>(handle->model->n_layer, handle->model->n_embed);
+        return handle.release();
+    }, (mgpt_model*)nullptr);
+}
+
+void mgpt_model_free(mgpt_model* model) {
+    delete model;
+}
+
+int mgpt_vocab_size(const mgpt_model* model) {
+    return model->model->vocab_size;
+}
+
+int mgpt_block_size(const mgpt_model* model) {
+    return model->model->block_size;
+}
+
+int mgpt_bos(const mgpt_model* model) {
+    return model->model->vocab_size - 1;
+}
+
+// live sessions hold KV caches of the current precision and keep feeding its
+// blocks to the prefix cache
+static void check_no_sessions(const mgpt_model* model) {
+    if (model->sessions > 0)
+        throw std::runtime_error("Error: cannot change the precision while sessions of the model exist.");
+}
+
+int mgpt_set_precision(mgpt_model* model, const char* precision) {
+    return guarded([=] {
+        std::lock_guard<std::mutex> lock(model->mutex);
+        check_no_sessions(model);
+        model->model->set_precision(parse_precision(precision));
+        model->prefix_cache->clear();
+        return 0;
+    }, -1);
+}
+
+int mgpt_set_kv_precision(mgpt_model* model, const char* precision) {
+    return guarded([=] {
+        std::lock_guard<std::mutex> lock(model->mutex);
+        check_no_sessions(model);
+        model->model->set_kv_precision(parse_precision(precision));
+        model->prefix_cache->clear();
+        return 0;
+    }, -1);
+}
+
+int mgpt_set_pipeline_stages(mgpt_model* model, int stages) {
+    return guarded([=] {
+        model->model->set_pipeline_stages(stages);
+        return 0;
+    }, -1);
+}
+
+mgpt_session* mgpt_session_create(mgpt_model* model, unsigned seed) {
+    return guarded([=]() -> mgpt_session* {
+        std::lock_guard<std::mutex> lock(model->mutex);
+        mgpt_session* session = new mgpt_session{model, InferenceSession(*model->model, seed, model->prefix_cache.get())};
+        model->sessions++;
+        return session;
+    }, (mgpt_session*)nullptr);
+}
+
+mgpt_session* mgpt_session_fork(const mgpt_session* session, unsigned seed) {
+    return guarded([=]() -> mgpt_session* {
+        std::lock_guard<std::mutex> lock(session->model->mutex);
+        mgpt_session* fork = new mgpt_session{session->model, session->session.fork(seed)};
+        session->model->sessions++;
+        return fork;
+    }, (mgpt_session*)nullptr);
+}
+
+void mgpt_session_free(mgpt_session* session) {
+    if (!session)
+        return;
+    // the pages of its KV cache are returned before the count allows a precision change
+    mgpt_model* model = session->model;
+    delete session;
+    std::lock_guard<std::mutex> lock(model->mutex);
+    model->sessions--;
+}
+
+void mgpt_session_reset(mgpt_session* session) {
+    session->session.reset();
+}
+
+const float* mgpt_prefill(mgpt_session* session, const int* tokens, int n) {
+    return guarded([=] { return session->session.prefill(tokens, n).data; }, (const float*)nullptr);
+}
+
+const float* mgpt_step(mgpt_session* session, int token) {
+    return guarded([=] { return session->session.step(token).data; }, (const float*)nullptr);
+}
+
+int mgpt_sample(mgpt_session* session, float temperature) {
+    return guarded([=] { return session->session.sample(temperature); }, -1);
+}
+
+int mgpt_score(mgpt_session* session, const int* tokens, int n, float* log_likelihood) {
+    return guarded([=] {
+        *log_likelihood = session->session.score(tokens, n);
+        return 0;
+    }, -1);
+}
+
+const char* mgpt_last_error(void) {
+    return last_error.c_str();
+}
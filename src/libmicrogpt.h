@@ -0,0 +1,71 @@
+#ifndef __LIBMICROGPT_H__
+#define __LIBMICROGPT_H__
+
+/*
+ * stable C API of libmicrogpt, for running the model in-process.
+ *
+ * tokens are character ids: token i is the letter 'a' + i, and the last id
+ * (vocab_size - 1) is BOS, which starts every document and ends a sample.
+ *
+ * a model is immutable once loaded and may be shared by any number of
+ * sessions on any number of threads. a session is one sequence and must only
+ * be used by one thread at a time. functions that fail return NULL or -1 and
+ * leave a message for mgpt_last_error() on the calling thread.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define MGPT_API __attribute__((visibility("default")))
+#else
+#define MGPT_API
+#endif
+
+typedef struct mgpt_model mgpt_model;
+typedef struct mgpt_session mgpt_session;
+
+/* load a checkpoint or an exported weight file (which is memory-mapped) */
+MGPT_API mgpt_model* mgpt_load(const char* path);
+MGPT_API void mgpt_model_free(mgpt_model* model);
+MGPT_API int mgpt_vocab_size(const mgpt_model* model);
+MGPT_API int mgpt_block_size(const mgpt_model* model);
+MGPT_API int mgpt_bos(const mgpt_model* model);
+/* run the linear layers in "f32", "int8" or "q4". -1 while sessions of the model
+ * exist, the prefix cache is emptied. safe against sessions being created or
+ * freed on other threads meanwhile */
+MGPT_API int mgpt_set_precision(mgpt_model* model, const char* precision);
+/* store the KV caches in "f32" or "int8". -1 while sessions of the model exist,
+ * the prefix cache is emptied. as safe as mgpt_set_precision */
+MGPT_API int mgpt_set_kv_precision(mgpt_model* model, const char* precision);
+/* run the layers of batched passes as a pipeline of stages, 1 (the default) turns it off */
+MGPT_API int mgpt_set_pipeline_stages(mgpt_model* model, int stages);
+
+/* sessions of one model share its prefix cache, the model must outlive them */
+MGPT_API mgpt_session* mgpt_session_create(mgpt_model* model, unsigned seed);
+MGPT_API void mgpt_session_free(mgpt_session* session);
+/* a new session continuing the sequence of session with its own seed. the KV
+ * cache so far is shared, not copied, until one of them writes to it */
+MGPT_API mgpt_session* mgpt_session_fork(const mgpt_session* session, unsigned seed);
+/* start a new sequence */
+MGPT_API void mgpt_session_reset(mgpt_session* session);
+
+/* feed n tokens in one batched pass, or a single token. both return the
+ * vocab_size logits predicting the next token, valid until the next call on
+ * the session */
+MGPT_API const float* mgpt_prefill(mgpt_session* session, const int* tokens, int n);
+MGPT_API const float* mgpt_step(mgpt_session* session, int token);
+/* draw the next token from the latest logits, -1 unless temperature > 0 */
+MGPT_API int mgpt_sample(mgpt_session* session, float temperature);
+/* log-likelihood of tokens[1..n) given the tokens before them, resets the session */
+MGPT_API int mgpt_score(mgpt_session* session, const int* tokens, int n, float* log_likelihood);
+
+/* message of the last failure on this thread */
+MGPT_API const char* mgpt_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,9 +1,57 @@
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <thread>
 #include "util.h"
 #include "model.hpp"
 #include "adam.hpp"
+#include "bench.hpp"
+#include "checkpoint.hpp"
+#include "data_loader.hpp"
+#include "libmicrogpt.h"
+#include "server.hpp"
+#include "session.hpp"
+#include "weights.hpp"
 
-int main() {
+// inference-only model from exactly one of a weight file or a checkpoint
+static std::unique_ptr<Model> load_model(const std::string& weights_path, const std::string& checkpoint_path) {
+    if (weights_path.empty() == checkpoint_path.empty())
+        throw std::runtime_error("Error: exactly one of --weights or --checkpoint is required.");
+    if (!weights_path.empty())
+        return std::make_unique<Model>(std::make_shared<WeightFile>(weights_path));
+    Checkpoint checkpoint = Checkpoint::read(checkpoint_path);
+    auto model = std::make_unique<Model>(checkpoint.vocab_size, ModelConfig::of(checkpoint));
+    model->restore(checkpoint);
+    model->pack_weights();
+    return model;
+}
+
+// mean_token_loss, plus the decode throughput it ran at
+static double timed_loss(const Model& model, const std::vector<std::string>& docs, int BOS, double& tokens_per_second) {
+    size_t num_tokens = 0;
+    auto start = std::chrono::steady_clock::now();
+    const double loss = mean_token_loss(model, docs, BOS, &num_tokens);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    tokens_per_second = num_tokens / elapsed.count();
+    return loss;
+}
+
+// comma separated integers, e.g. "16,32,64"
+static std::vector<int> parse_list(const std::string& list) {
+    std::vector<int> values;
+    std::istringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ','))
+        values.push_back(std::stoi(item));
+    if (values.empty())
+        throw std::runtime_error("Error: empty list \"" + list + "\".");
+    return values;
+}
+
+static std::vector<std::string> load_docs() {
     // open local file (or remote location if not downloaded)
     auto ifstream = open_url_cached("https://raw.githubusercontent.com/karpathy/makemore/refs/heads/master/names.txt");
 
@@ -12,6 +60,209 @@ int main() {
     std::string line;
     while (std::getline(ifstream, line))
         docs.push_back(line);
+    return docs;
+}
+
+// zero-copy startup through the embedding API: no init, no training, weights are used in place from the mapping
+static void sample_from_weights(const std::string& path, const std::string& prompt, Precision precision, Precision kv_precision,
+                                int pipeline_stages, int num_samples, float temperature) {
+    std::unique_ptr<mgpt_model, void (*)(mgpt_model*)> model(mgpt_load(path.c_str()), mgpt_model_free);
+    if (!model || (precision != Precision::F32 && mgpt_set_precision(model.get(), precision_name(precision)) != 0) ||
+        mgpt_set_kv_precision(model.get(), precision_name(kv_precision)) != 0 ||
+        mgpt_set_pipeline_stages(model.get(), pipeline_stages) != 0)
+        throw std::runtime_error(mgpt_last_error());
+    std::unique_ptr<mgpt_session, void (*)(mgpt_session*)> session(mgpt_session_create(model.get(), std::default_random_engine::default_seed), mgpt_session_free);
+    if (!session)
+        throw std::runtime_error(mgpt_last_error());
+    const int BOS = mgpt_bos(model.get());
+    const std::vector<int> tokens = tokenize_prompt(prompt, BOS);
+
+    std::cout << "Inferring " << num_samples << " samples with temperature " << temperature << std::endl;
+    for (int i = 0; i < num_samples; i++) {
+        if (!mgpt_prefill(session.get(), tokens.data(), tokens.size()))
+            throw std::runtime_error(mgpt_last_error());
+        std::vector<int> sample(tokens.begin() + 1, tokens.end());
+        for (size_t length = tokens.size();; length++) {
+            const int token = mgpt_sample(session.get(), temperature);
+            if (token == BOS)
+                break;
+            sample.push_back(token);
+            if ((int)length >= mgpt_block_size(model.get()) || !mgpt_step(session.get(), token))
+                break;
+        }
+        mgpt_session_reset(session.get());
+        std::cout << "sample: " << detokenize(sample) << std::endl;
+    }
+}
+
+static int run(int argc, char** argv) {
+    // how documents are grouped into batches
+    Sampling sampling = Sampling::Shuffled;
+    size_t batch_size = 1;
+    int num_steps = 1000;
+    // training checkpoints: where to save them, how often, and whether to resume from one
+    std::string checkpoint_path;
+    int checkpoint_every = 0;
+    bool resume = false;
+    // skip training entirely and sample from a checkpoint
+    bool sample_only = false;
+    // inference weight files: export one after training, or sample from a mapped one
+    std::string export_path;
+    std::string weights_path;
+    // every sample completes this prefix
+    std::string prompt;
+    // format of the linear layer weights on the inference path
+    Precision precision = Precision::F32;
+    // format of the KV caches of the inference path
+    Precision kv_precision = Precision::F32;
+    // layer ranges that batched inference passes pipeline micro-batches through
+    int pipeline_stages = 1;
+    // `microgpt serve`: HTTP inference server over a checkpoint or weight file
+    bool serving = argc > 1 && std::string(argv[1]) == "serve";
+    // `microgpt quantize`: accuracy and speed of a lower precision against f32 on names.txt
+    bool quantizing = argc > 1 && std::string(argv[1]) == "quantize";
+    // `microgpt bench`: step time, decode speed and memory across model shapes
+    bool benchmarking = argc > 1 && std::string(argv[1]) == "bench";
+    // shape of a freshly trained model, from a config file and/or single dimensions
+    ModelConfig config;
+    std::vector<int> widths = {16, 32, 64};
+    std::vector<int> depths = {1, 2, 4};
+    std::string host = "0.0.0.0";
+    int port = 8080;
+    int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    int max_batch = 64;
+    for (int i = serving || quantizing || benchmarking ? 2 : 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--pack")
+            sampling = Sampling::Packed;
+        else if (arg == "--bucket")
+            sampling = Sampling::Bucketed;
+        else if (arg == "--batch-size" && i + 1 < argc) {
+            const int size = std::stoi(argv[++i]);
+            if (size < 1)
+                throw std::runtime_error("Error: --batch-size must be at least 1.");
+            batch_size = size;
+        }
+        else if (arg == "--steps" && i + 1 < argc)
+            num_steps = std::stoi(argv[++i]);
+        else if (arg == "--checkpoint" && i + 1 < argc)
+            checkpoint_path = argv[++i];
+        else if (arg == "--checkpoint-every" && i + 1 < argc)
+            checkpoint_every = std::stoi(argv[++i]);
+        else if (arg == "--resume")
+            resume = true;
+        else if (arg == "--sample-only")
+            sample_only = true;
+        else if (arg == "--export-weights" && i + 1 < argc)
+            export_path = argv[++i];
+        else if (arg == "--weights" && i + 1 < argc)
+            weights_path = argv[++i];
+        else if (arg == "--precision" && i + 1 < argc)
+            precision = parse_precision(argv[++i]);
+        else if (arg == "--kv-precision" && i + 1 < argc)
+            kv_precision = parse_precision(argv[++i]);
+        else if (arg == "--pipeline-stages" && i + 1 < argc)
+            pipeline_stages = std::stoi(argv[++i]);
+        else if (arg == "--prompt" && i + 1 < argc)
+            prompt = argv[++i];
+        else if (arg == "--host" && i + 1 < argc)
+            host = argv[++i];
+        else if (arg == "--port" && i + 1 < argc)
+            port = std::stoi(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            num_threads = std::stoi(argv[++i]);
+        else if (arg == "--max-batch" && i + 1 < argc) {
+            max_batch = std::stoi(argv[++i]);
+            if (max_batch < 1)
+                throw std::runtime_error("Error: --max-batch must be at least 1.");
+        }
+        else if (arg == "--config" && i + 1 < argc)
+            config = ModelConfig::read(argv[++i]);
+        else if (arg == "--n-embed" && i + 1 < argc)
+            config.n_embed = std::stoi(argv[++i]);
+        else if (arg == "--n-head" && i + 1 < argc)
+            config.n_head = std::stoi(argv[++i]);
+        else if (arg == "--n-layer" && i + 1 < argc)
+            config.n_layer = std::stoi(argv[++i]);
+        else if (arg == "--block-size" && i + 1 < argc)
+            config.block_size = std::stoi(argv[++i]);
+        else if (arg == "--widths" && i + 1 < argc)
+            widths = parse_list(argv[++i]);
+        else if (arg == "--depths" && i + 1 < argc)
+            depths = parse_list(argv[++i]);
+        else
+            throw std::runtime_error("Error: unknown argument \"" + arg + "\".");
+    }
+    // q4 is the one lower precision that is also a storage format
+    const TensorType export_type = precision == Precision::Q4 ? TensorType::Q4 : TensorType::F32;
+    if ((resume || sample_only || checkpoint_every > 0) && checkpoint_path.empty())
+        throw std::runtime_error("Error: --resume, --sample-only and --checkpoint-every require --checkpoint.");
+
+    if (serving) {
+        std::unique_ptr<Model> model = load_model(weights_path, checkpoint_path);
+        if (precision != Precision::F32)
+            model->set_precision(precision);
+        model->set_kv_precision(kv_precision);
+        model->set_pipeline_stages(pipeline_stages);
+        serve(*model, model->vocab_size - 1, host, port, num_threads, max_batch);
+        return 0;
+    }
+
+    if (quantizing) {
+        if (precision == Precision::F32 && kv_precision == Precision::F32)
+            precision = Precision::Int8;
+        std::unique_ptr<Model> model = load_model(weights_path, checkpoint_path);
+        if (model->get_precision() != Precision::F32)
+            throw std::runtime_error("Error: quantize needs f32 weights to compare against.");
+        model->set_pipeline_stages(pipeline_stages);
+        std::vector<std::string> docs = load_docs();
+        const int BOS = model->vocab_size - 1;
+        const size_t f32_bytes = model->linear_bytes();
+        const size_t f32_kv_bytes = model->make_cache().bytes_per_position();
+        double f32_speed, quantized_speed;
+        const double f32_loss = timed_loss(*model, docs, BOS, f32_speed);
+        if (precision != Precision::F32)
+            model->set_precision(precision);
+        model->set_kv_precision(kv_precision);
+        const double quantized_loss = timed_loss(*model, docs, BOS, quantized_speed);
+        const std::string name = std::string(precision_name(precision)) + (kv_precision != Precision::F32 ? " with int8 KV cache" : "");
+        std::cout << "Per-token loss on " << docs.size() << " docs: f32 " << f32_loss << ", " << name << " "
+                  << quantized_loss << " (" << (quantized_loss >= f32_loss ? "+" : "") << quantized_loss - f32_loss << ")" << std::endl;
+        std::cout << "Decode: f32 " << (long)f32_speed << " tok/s, " << name << " " << (long)quantized_speed << " tok/s" << std::endl;
+        if (precision != Precision::F32)
+            std::cout << "Linear weights: f32 " << f32_bytes << " bytes, " << precision_name(precision) << " " << model->linear_bytes()
+                      << " bytes (" << (double)f32_bytes / model->linear_bytes() << "x smaller)" << std::endl;
+        if (kv_precision != Precision::F32) {
+            const size_t kv_bytes = model->make_cache().bytes_per_position();
+            std::cout << "KV cache: f32 " << f32_kv_bytes << " bytes per position, int8 " << kv_bytes << " bytes ("
+                      << (double)f32_kv_bytes / kv_bytes << "x smaller)" << std::endl;
+        }
+        if (pipeline_stages > 1)
+            print_pipeline_stats(model->pipeline_stats());
+        return 0;
+    }
+
+    if (!weights_path.empty()) {
+        sample_from_weights(weights_path, prompt, precision, kv_precision, pipeline_stages, 30, .5f);
+        return 0;
+    }
+
+    if (sample_only) {
+        // the checkpoint carries everything needed for sampling, no dataset required
+        Checkpoint checkpoint = Checkpoint::read(checkpoint_path);
+        Model model(checkpoint.vocab_size, ModelConfig::of(checkpoint));
+        model.restore(checkpoint);
+        if (!export_path.empty())
+            WeightFile::write(export_path, checkpoint, export_type);
+        model.pack_weights();
+        model.set_precision(precision);
+        model.set_kv_precision(kv_precision);
+        model.set_pipeline_stages(pipeline_stages);
+        model.infer(checkpoint.vocab_size - 1, 30, .5f, prompt);
+        return 0;
+    }
+
+    std::vector<std::string> docs = load_docs();
 
     // let there be a tokenizer to translate string to discrete symbols and back
     std::set<char> unique_chars;
@@ -24,13 +275,52 @@ int main() {
     int vocab_size = unique_chars.size() + 1;
     std::cout << "Initialized vocabulary of size " << vocab_size << std::endl;
 
+    if (benchmarking) {
+        benchmark(docs, vocab_size, config, widths, depths, num_steps);
+        return 0;
+    }
+
+    // a resumed run keeps the shape it was trained with
+    std::optional<Checkpoint> resumed;
+    if (resume) {
+        resumed = Checkpoint::read(checkpoint_path);
+        config = ModelConfig::of(*resumed);
+    }
+
     // initialize model, especially the params, so there be stored values
-    Model model(vocab_size);
-    Adam adam(1000);
-    adam.train(model, docs, BOS);
+    Model model(vocab_size, config);
+    Adam adam(num_steps, checkpoint_path, checkpoint_every);
+    // tokenize, shuffle and batch docs on a background thread
+    DataLoader loader(docs, BOS, model.block_size + 1, batch_size, 42, 2, sampling);
+    if (resumed) {
+        model.restore(*resumed);
+        adam.restore(*resumed);
+        loader.restore(*resumed);
+    }
+    adam.train(model, loader, BOS);
+
+    if (!export_path.empty()) {
+        Checkpoint checkpoint;
+        model.snapshot(checkpoint);
+        WeightFile::write(export_path, checkpoint, export_type);
+    }
 
     // perform inference
-    model.infer(BOS, 30);
+    model.pack_weights();
+    model.set_precision(precision);
+    model.set_kv_precision(kv_precision);
+    model.set_pipeline_stages(pipeline_stages);
+    model.infer(BOS, 30, .5f, prompt);
 
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char** argv) {
+    // every error surfaces as an exception with a readable "Error: ..." message
+    try {
+        return run(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+}
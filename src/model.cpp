@@ -1,9 +1,75 @@
 #include "model.hpp"
 #include "value.hpp"
+#include "data_loader.hpp"
+#include "prefix_cache.hpp"
+#include "session.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+ModelConfig ModelConfig::read(const std::string& path) {
+    std::ifstream file(path);
+    if (!file)
+        throw std::runtime_error("Error: could not open config \"" + path + "\".");
+    ModelConfig config;
+    std::string line;
+    while (std::getline(file, line)) {
+        line = line.substr(0, line.find('#'));
+        const size_t equals = line.find('=');
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+        std::istringstream key_in(line.substr(0, equals)), value_in(equals == std::string::npos ? "" : line.substr(equals + 1));
+        std::string key;
+        int value;
+        if (!(key_in >> key) || !(value_in >> value) || !config.set(key, value))
+            throw std::runtime_error("Error: bad line \"" + line + "\" in config \"" + path + "\".");
+    }
+    config.validate();
+    return config;
+}
+
+ModelConfig ModelConfig::of(const Checkpoint& checkpoint) {
+    return ModelConfig{checkpoint.n_embed, checkpoint.n_head, checkpoint.n_layer, checkpoint.block_size};
+}
+
+bool ModelConfig::set(const std::string& key, int value) {
+    if (key == "n_embed")
+        n_embed = value;
+    else if (key == "n_head")
+        n_head = value;
+    else if (key == "n_layer")
+        n_layer = value;
+    else if (key == "block_size")
+        block_size = value;
+    else
+        return false;
+    return true;
+}
+
+void ModelConfig::validate() const {
+    if (n_embed < 1 || n_head < 1 || n_layer < 1 || block_size < 1)
+        throw std::runtime_error("Error: model dimensions must be positive.");
+    if (n_embed % n_head != 0)
+        throw std::runtime_error("Error: n_embed " + std::to_string(n_embed) + " is not divisible by n_head " + std::to_string(n_head) + ".");
+}
 
-Model::Model(size_t vocab_size) {
+Model::Model(size_t vocab_size, const ModelConfig& config) {
+    config.validate();
+    this->vocab_size = vocab_size;
+    n_embed = config.n_embed;
+    n_head = config.n_head;
+    n_layer = config.n_layer;
+    block_size = config.block_size;
+    head_dim = n_embed / n_head;
     weights["wte"] = initialize_matrix(vocab_size, n_embed);
     weights["wpe"] = initialize_matrix(block_size, n_embed);
     weights["lm_head"] = initialize_matrix(vocab_size, n_embed);
@@ -22,52 +88,289 @@ Model::Model(size_t vocab_size) {
         std::cout << key << " ";
 
     std::cout << "] with normdist(mean=" << dist_mean << ", std_dev=" << dist_std_dev << ")" << std::endl;
-    std::cout << "Created model(n_embed=" << n_embed << ", n_head=" << n_head << ", n_layer=" << n_layer << ", head_dim=" << head_dim << ")" << std::endl;
+    kv_pool = std::make_shared<KVPagePool>(n_layer, n_embed, n_head, false);
+    kernels = &shape_kernels(n_embed, n_head, block_size);
+    std::cout << "Created model(n_embed=" << n_embed << ", n_head=" << n_head << ", n_layer=" << n_layer << ", head_dim=" << head_dim
+              << ", kernels=" << kernels->name << ")" << std::endl;
 }
 
-void Model::infer(int BOS, size_t num_samples, float temperature) {
-    std::cout << "Inferring " << num_samples << " samples with temperature " << temperature << std::endl;
+Model::Model(std::shared_ptr<WeightFile> file) {
+    // the header is untrusted input, check it before dividing by n_head
+    ModelConfig{file->n_embed, file->n_head, file->n_layer, file->block_size}.validate();
+    vocab_size = file->vocab_size;
+    n_embed = file->n_embed;
+    n_head = file->n_head;
+    n_layer = file->n_layer;
+    block_size = file->block_size;
+    head_dim = n_embed / n_head;
+    // linear layers stored as Q4 run as Q4
+    if (!file->q4_tensors.empty())
+        precision = Precision::Q4;
+    bind_views(file->tensors, file->q4_tensors);
+    mapped = std::move(file);
+    kv_pool = std::make_shared<KVPagePool>(n_layer, n_embed, n_head, false);
+    kernels = &shape_kernels(n_embed, n_head, block_size);
+    std::cout << "Created model(n_embed=" << n_embed << ", n_head=" << n_head << ", n_layer=" << n_layer << ", head_dim=" << head_dim
+              << ", kernels=" << kernels->name << ")" << std::endl;
+}
 
-    for (int step = 0; step < num_samples; step++) {
-        std::vector<matrix_t> keys, values;
-        prepare_tensors(keys, values, n_layer);
+void Model::bind_views(const std::map<std::string, WeightView>& views, const std::map<std::string, Q4View>& q4_views) {
+    auto view = [&](const std::string& name, int rows, int cols) {
+        auto it = views.find(name);
+        if (it == views.end() || it->second.rows != rows || it->second.cols != cols)
+            throw std::runtime_error("Error: missing or misshapen weight \"" + name + "\".");
+        return it->second;
+    };
+    auto linear_view = [&](const std::string& name, int rows, int cols) {
+        auto it = q4_views.find(name);
+        if (it == q4_views.end())
+            return LinearWeights{view(name, rows, cols)};
+        if (it->second.rows != rows || it->second.cols != cols)
+            throw std::runtime_error("Error: misshapen weight \"" + name + "\".");
+        LinearWeights w;
+        w.q4.view = it->second;
+        return w;
+    };
+    wte_view = view("wte", vocab_size, n_embed);
+    wpe_view = view("wpe", block_size, n_embed);
+    lm_head_weights = linear_view("lm_head", vocab_size, n_embed);
+    layer_views.clear();
+    for (int i = 0; i < n_layer; ++i) {
+        std::string prefix = "layer" + std::to_string(i) + "_";
+        layer_views.push_back(LayerWeights{
+            linear_view(prefix + "attn_wq", n_embed, n_embed),
+            linear_view(prefix + "attn_wk", n_embed, n_embed),
+            linear_view(prefix + "attn_wv", n_embed, n_embed),
+            linear_view(prefix + "attn_wo", n_embed, n_embed),
+            linear_view(prefix + "mlp_fc1", 4 * n_embed, n_embed),
+            linear_view(prefix + "mlp_fc2", n_embed, 4 * n_embed),
+        });
+    }
+    // freshly packed weights need new quantized copies
+    quantize_weights();
+}
 
-        int token_id = BOS;
-        std::vector<int> sample;
-        value_t temp_value = value_from(temperature);
-        for (int pos_id = 0; pos_id < block_size; pos_id++) {
-            // calculate logits like usual
-            vector_t logits = gpt(token_id, pos_id, keys, values);
+Precision parse_precision(const std::string& name) {
+    if (name == "f32")
+        return Precision::F32;
+    if (name == "int8")
+        return Precision::Int8;
+    if (name == "q4")
+        return Precision::Q4;
+    if (name == "f16")
+        return Precision::F16;
+    if (name == "bf16")
+        return Precision::BF16;
+    throw std::runtime_error("Error: unknown precision \"" + name + "\", expected f32, f16, bf16, int8 or q4.");
+}
 
-            // make our logits hotter (or colder, or even just warm)
-            vector_t hot_logits;
-            hot_logits.reserve(logits.size());
-            for (auto& logit : logits)
-                hot_logits.push_back(logit / temp_value);
+const char* precision_name(Precision precision) {
+    switch (precision) {
+    case Precision::Int8: return "int8";
+    case Precision::Q4: return "q4";
+    case Precision::F16: return "f16";
+    case Precision::BF16: return "bf16";
+    default: return "f32";
+    }
+}
 
-            vector_t probabilities = softmax(hot_logits);
+void Model::set_precision(Precision precision) {
+    this->precision = precision;
+    quantize_weights();
+    if (precision == Precision::Int8)
+        std::cout << "Running linear layers in int8 (" << int8_kernel_name() << " kernels), " << linear_bytes() << " bytes of weights" << std::endl;
+    else if (precision == Precision::Q4)
+        std::cout << "Running linear layers in q4 (" << q4_kernel_name() << " kernels), " << linear_bytes() << " bytes of weights" << std::endl;
+    else if (precision == Precision::F16 || precision == Precision::BF16)
+        std::cout << "Running linear layers in " << precision_name(precision) << " with f32 accumulation ("
+                  << half_kernel_name(precision == Precision::BF16) << " kernels), " << linear_bytes() << " bytes of weights" << std::endl;
+}
 
-            std::vector<float> weights;
-            weights.reserve(probabilities.size());
-            float dist_sum = 0.f;
-            for (auto& p : probabilities) {
-                weights.push_back(p->data);
-                dist_sum += p->data;
-            }
-            assert(dist_sum - 1.f < 1e-3);
+void Model::quantize_weights() {
+    auto convert = [this](LinearWeights& w) {
+        if (!w.f32.data) {
+            // loaded as Q4, there is nothing to convert from
+            if (precision != Precision::Q4)
+                throw std::runtime_error("Error: weights are stored as q4 and can only run as q4.");
+            return;
+        }
+        w.int8 = precision == Precision::Int8 ? Int8Matrix::quantize(w.f32) : Int8Matrix{};
+        w.q4 = precision == Precision::Q4 ? Q4Matrix::quantize(w.f32) : Q4Matrix{};
+        const bool half = precision == Precision::F16 || precision == Precision::BF16;
+        w.half = half ? HalfMatrix::convert(w.f32, precision == Precision::BF16) : HalfMatrix{};
+    };
+    convert(lm_head_weights);
+    for (LayerWeights& layer : layer_views)
+        for (LinearWeights* w : {&layer.attn_wq, &layer.attn_wk, &layer.attn_wv, &layer.attn_wo, &layer.mlp_fc1, &layer.mlp_fc2})
+            convert(*w);
+}
 
-            std::discrete_distribution<> discrete_dist(weights.begin(), weights.end());
-            token_id = discrete_dist(generator);
-            if (token_id == BOS)
-                break;
-            sample.push_back(token_id);
+size_t Model::linear_bytes() const {
+    auto bytes = [this](const LinearWeights& w) {
+        switch (precision) {
+        case Precision::Int8: return w.int8.bytes();
+        case Precision::Q4: return w.q4.bytes();
+        case Precision::F16:
+        case Precision::BF16: return w.half.bytes();
+        default: return (size_t)w.f32.rows * w.f32.cols * sizeof(float);
         }
+    };
+    size_t total = bytes(lm_head_weights);
+    for (const LayerWeights& layer : layer_views)
+        for (const LinearWeights* w : {&layer.attn_wq, &layer.attn_wk, &layer.attn_wv, &layer.attn_wo, &layer.mlp_fc1, &layer.mlp_fc2})
+            total += bytes(*w);
+    return total;
+}
+
+void Model::set_kv_precision(Precision precision) {
+    if (precision != Precision::F32 && precision != Precision::Int8)
+        throw std::runtime_error("Error: the KV cache can only be stored as f32 or int8.");
+    kv_precision = precision;
+    kv_pool = std::make_shared<KVPagePool>(n_layer, n_embed, n_head, precision == Precision::Int8);
+    if (precision == Precision::Int8)
+        std::cout << "Storing KV caches in int8, one scale per head and position" << std::endl;
+}
+
+void Model::set_pipeline_stages(int stages) {
+    if (stages < 1 || stages > n_layer)
+        throw std::runtime_error("Error: cannot pipeline " + std::to_string(n_layer) + " layers over " + std::to_string(stages) + " stages.");
+    pipeline_stages = stages;
+    std::lock_guard<std::mutex> lock(pipeline_mutex);
+    pipeline_totals = PipelineStats();
+    pipeline_totals.stages = stages;
+    if (stages > 1)
+        std::cout << "Pipelining " << n_layer << " layers over " << stages << " stages" << std::endl;
+}
+
+PipelineStats Model::pipeline_stats() const {
+    std::lock_guard<std::mutex> lock(pipeline_mutex);
+    return pipeline_totals;
+}
+
+KVCache Model::make_cache() const {
+    return KVCache(kv_pool);
+}
+
+void Model::pack_weights() {
+    size_t total = 0;
+    for (auto& [key, matrix] : weights)
+        total += matrix.size() * matrix[0].size();
+    packed.resize(total);
 
-        std::cout << "sample: ";
-        for (auto s : sample)
-            std::cout << (char)('a' + (char)s);
-        std::cout << std::endl;
+    std::map<std::string, WeightView> views;
+    float* out = packed.data();
+    for (auto& [key, matrix] : weights) {
+        views[key] = WeightView{out, (int)matrix.size(), (int)matrix[0].size()};
+        for (auto& row : matrix)
+            for (auto& val : row)
+                *out++ = val->data;
     }
+    bind_views(views);
+}
+
+void Model::snapshot(Checkpoint& checkpoint) {
+    checkpoint.vocab_size = weights["wte"].size();
+    checkpoint.n_embed = n_embed;
+    checkpoint.n_head = n_head;
+    checkpoint.n_layer = n_layer;
+    checkpoint.block_size = block_size;
+
+    checkpoint.tensors.clear();
+    for (auto& [key, matrix] : weights) {
+        Tensor tensor{key, (int)matrix.size(), (int)matrix[0].size(), {}};
+        tensor.data.reserve(tensor.rows * tensor.cols);
+        for (auto& row : matrix)
+            for (auto& val : row)
+                tensor.data.push_back(val->data);
+        checkpoint.tensors.push_back(std::move(tensor));
+    }
+
+    std::ostringstream rng;
+    rng << generator;
+    checkpoint.rng_state = rng.str();
+}
+
+void Model::restore(const Checkpoint& checkpoint) {
+    if (checkpoint.n_embed != n_embed || checkpoint.n_head != n_head || checkpoint.n_layer != n_layer ||
+        checkpoint.block_size != block_size || checkpoint.vocab_size != (int)weights["wte"].size())
+        throw std::runtime_error("Error: checkpoint shape does not match the model.");
+
+    // a truncated or older checkpoint would leave the missing weights at their random init
+    std::set<std::string> restored;
+    for (const Tensor& tensor : checkpoint.tensors)
+        restored.insert(tensor.name);
+    for (const auto& [name, matrix] : weights)
+        if (!restored.count(name))
+            throw std::runtime_error("Error: checkpoint is missing weight tensor \"" + name + "\".");
+
+    for (const Tensor& tensor : checkpoint.tensors) {
+        auto it = weights.find(tensor.name);
+        if (it == weights.end() || (int)it->second.size() != tensor.rows || (int)it->second[0].size() != tensor.cols)
+            throw std::runtime_error("Error: unexpected checkpoint tensor \"" + tensor.name + "\".");
+        size_t i = 0;
+        for (auto& row : it->second)
+            for (auto& val : row)
+                val->data = tensor.data[i++];
+    }
+
+    std::istringstream rng(checkpoint.rng_state);
+    rng >> generator;
+    std::cout << "Restored " << checkpoint.tensors.size() << " weight tensors from checkpoint" << std::endl;
+}
+
+void Model::infer(int BOS, size_t num_samples, float temperature, const std::string& prompt) {
+    std::cout << "Inferring " << num_samples << " samples with temperature " << temperature;
+    if (!prompt.empty())
+        std::cout << " from prompt \"" << prompt << "\"";
+    std::cout << std::endl;
+    const std::vector<int> prompt_tokens = tokenize_prompt(prompt, BOS);
+
+    // trained weights might have changed since the last pack
+    if (!weights.empty())
+        pack_weights();
+
+    // the session draws from a copy of the generator, the model itself stays untouched
+    PrefixCache prefix_cache(n_layer, n_embed);
+    InferenceSession session(*this, generator, &prefix_cache);
+    for (size_t step = 0; step < num_samples; step++) {
+        std::vector<int> sample(prompt_tokens.begin() + 1, prompt_tokens.end());
+        for (int token_id : session.tokens(prompt_tokens, temperature, block_size))
+            sample.push_back(token_id);
+        std::cout << "sample: " << detokenize(sample) << std::endl;
+    }
+    prefix_cache.print_stats();
+    KVPoolStats pages = kv_pool->stats();
+    std::cout << "KV cache: peak of " << pages.peak << " pages of " << pages.page_bytes << " bytes, " << pages.copies << " copied on write" << std::endl;
+    if (pipeline_stages > 1)
+        print_pipeline_stats(pipeline_stats());
+}
+
+void print_pipeline_stats(const PipelineStats& stats) {
+    std::cout << "Pipeline: " << stats.passes << " passes over " << stats.stages << " stages, " << stats.micro_batches << " micro-batches in "
+              << stats.ticks << " ticks, bubble " << std::fixed << std::setprecision(1) << 100. * stats.bubble()
+              << "% of stage slots, stages idle " << 100. * stats.idle() << std::defaultfloat << "% of the time" << std::endl;
+}
+
+int sample_token(float* logits, int n, float temperature, std::default_random_engine& rng) {
+    // make our logits hotter (or colder, or even just warm)
+    const float inv_temperature = std::pow(temperature, -1.f);
+    for (int i = 0; i < n; i++)
+        logits[i] *= inv_temperature;
+    softmax_inplace(logits, n);
+
+    // inverse CDF over the normalized probabilities, draws the same tokens as
+    // std::discrete_distribution without building its table on every call
+    double total = 0.;
+    for (int i = 0; i < n; i++)
+        total += logits[i];
+    const double p = std::generate_canonical<double, std::numeric_limits<double>::digits>(rng);
+    double cumulative = 0.;
+    for (int i = 0; i < n - 1; i++) {
+        cumulative += logits[i] / total;
+        if (cumulative >= p)
+            return i;
+    }
+    return n - 1;
 }
 
 matrix_t Model::initialize_matrix(int n_out, int n_in) {
@@ -140,7 +443,11 @@ vector_t Model::rms_norm(vector_t& x) {
     return ret;
 }
 
-vector_t Model::gpt(int token_id, int pos_id, std::vector<matrix_t>& keys, std::vector<matrix_t>& values) {
+const vector_t& Model::token_embedding(int token_id) {
+    return weights["wte"][token_id];
+}
+
+vector_t Model::embed(int token_id, int pos_id) {
     // load token embedding
     vector_t& token_emb = weights["wte"][token_id];
     // load position embedding
@@ -152,7 +459,14 @@ vector_t Model::gpt(int token_id, int pos_id, std::vector<matrix_t>& keys, std::
     x.reserve(token_emb.size());
     for (size_t i = 0; i < token_emb.size(); i++)
         x.push_back(token_emb[i] + pos_emb[i]);
+    return x;
+}
 
+vector_t Model::gpt(int token_id, int pos_id, std::vector<matrix_t>& keys, std::vector<matrix_t>& values) {
+    return gpt(embed(token_id, pos_id), keys, values);
+}
+
+vector_t Model::gpt(vector_t x, std::vector<matrix_t>& keys, std::vector<matrix_t>& values) {
     // compute root-mean-square norm
     x = rms_norm(x);
 
@@ -170,37 +484,40 @@ vector_t Model::gpt(int token_id, int pos_id, std::vector<matrix_t>& keys, std::
         const int seq_len = keys[li].size();
         const float inv_sqrt_d = 1.f / std::sqrt((float)head_dim);
 
-        vector_t x_attn;
-        x_attn.reserve(n_embed);
-
-        for (int h = 0; h < n_head; h++) {
-            const int hs = h * head_dim;
-
-            // compute attention logits without copying slices:
-            // score[t] = sum_j q[hs+j] * k_t[hs+j] (using dot_slice)
-            vector_t attn_logits;
-            attn_logits.reserve(seq_len);
-            value_t inv_sqrt_val = value_from(inv_sqrt_d);
-            for (int t = 0; t < seq_len; t++) {
-                value_t score = dot_slice(q, hs, keys[li][t], hs, head_dim);
-                attn_logits.push_back(score * inv_sqrt_val);
+        // heads are independent, each task builds the nodes of whole heads and
+        // writes its own slice of x_attn. tiny heads are not worth a task: the
+        // grain is a head count of at least ~1k nodes
+        vector_t x_attn(n_embed);
+        parallel_for(0, n_head, grain_size((size_t)seq_len * head_dim * 2, 1 << 10), [&](int first, int last) {
+            for (int h = first; h < last; h++) {
+                const int hs = h * head_dim;
+
+                // compute attention logits without copying slices:
+                // score[t] = sum_j q[hs+j] * k_t[hs+j] (using dot_slice)
+                vector_t attn_logits;
+                attn_logits.reserve(seq_len);
+                value_t inv_sqrt_val = value_from(inv_sqrt_d);
+                for (int t = 0; t < seq_len; t++) {
+                    value_t score = dot_slice(q, hs, keys[li][t], hs, head_dim);
+                    attn_logits.push_back(score * inv_sqrt_val);
+                }
+
+                vector_t attn_weights = softmax(attn_logits);
+
+                // weighted sum over value vectors (again using slice offsets)
+                for (int j = 0; j < head_dim; j++) {
+                    value_t head_out = value_from(0.f);
+                    for (int t = 0; t < seq_len; t++)
+                        head_out = head_out + (attn_weights[t] * values[li][t][hs + j]);
+                    x_attn[hs + j] = head_out;
+                }
             }
-
-            vector_t attn_weights = softmax(attn_logits);
-
-            // weighted sum over value vectors (again using slice offsets)
-            for (int j = 0; j < head_dim; j++) {
-                value_t head_out = value_from(0.f);
-                for (int t = 0; t < seq_len; t++)
-                    head_out = head_out + (attn_weights[t] * values[li][t][hs + j]);
-                x_attn.push_back(head_out);
-            }
-        }
+        });
 
         x = linear(x_attn, weights[prefix + "attn_wo"]);
 
         // residual add
-        for (int i = 0; i < x.size(); i++)
+        for (int i = 0; i < (int)x.size(); i++)
             x[i] = x[i] + x_residual[i];
         x_residual = x;
 
@@ -221,3 +538,250 @@ vector_t Model::gpt(int token_id, int pos_id, std::vector<matrix_t>& keys, std::
     vector_t logits = linear(x, weights["lm_head"]);
     return logits;
 }
+
+// no-grad float kernels, mirroring the Value ops above operation for operation
+// so both paths produce the same numbers
+
+// batch rows of x through one linear layer in the selected precision
+void Model::linear(const LinearWeights& w, const float* x, float* y, int batch, ForwardScratch& scratch) const {
+    if (precision == Precision::F32) {
+        kernels->matmul(w.f32, x, y, batch);
+        return;
+    }
+    if (precision == Precision::Q4) {
+        matmul_q4(w.q4.view, x, y, batch, scratch.x_padded);
+        return;
+    }
+    if (precision == Precision::F16 || precision == Precision::BF16) {
+        matmul_half(w.half, x, y, batch, scratch.x_padded);
+        return;
+    }
+    scratch.xq.resize((size_t)batch * w.int8.stride);
+    scratch.x_scales.resize(batch);
+    quantize_rows(x, batch, w.int8.cols, w.int8.stride, scratch.xq.data(), scratch.x_scales.data());
+    matmul_int8(w.int8, scratch.xq.data(), scratch.x_scales.data(), y, batch);
+}
+
+void softmax_inplace(float* logits, size_t n) {
+    float max_value = logits[0];
+    for (size_t i = 1; i < n; i++)
+        max_value = std::max(max_value, logits[i]);
+    float total = 0.f;
+    for (size_t i = 0; i < n; i++) {
+        logits[i] = std::exp(logits[i] - max_value);
+        total = total + logits[i];
+    }
+    const float inv_total = std::pow(total, -1.f);
+    for (size_t i = 0; i < n; i++)
+        logits[i] = logits[i] * inv_total;
+}
+
+std::vector<float>& Model::forward(int token_id, int pos_id, KVCache& cache, ForwardScratch& scratch) const {
+    KVCache* caches[] = {&cache};
+    return forward_batch(&token_id, &pos_id, caches, 1, scratch);
+}
+
+// transformer layers for a batch of rows, leaves the final hidden states in scratch.x.
+// row b writes its key and value at position pos_ids[b] of its cache and attends to
+// every position up to it, so consecutive positions of one sequence can share a batch
+// layers [first_layer, last_layer) over the batch rows in scratch.x, in place
+void Model::forward_layers(int first_layer, int last_layer, const int* pos_ids, KVCache* const* caches, int batch,
+                           ForwardScratch& scratch) const {
+    const size_t width = (size_t)batch * n_embed;
+    std::vector<float>& x = scratch.x;
+    std::vector<float>& x_residual = scratch.x_residual;
+    std::vector<float>& q = scratch.q;
+    std::vector<float>& k = scratch.k;
+    std::vector<float>& v = scratch.v;
+    std::vector<float>& x_attn = scratch.x_attn;
+    std::vector<float>& hidden = scratch.hidden;
+    std::vector<float>& attn_logits = scratch.attn_logits;
+    x_residual.resize(width);
+    q.resize(width);
+    k.resize(width);
+    v.resize(width);
+    x_attn.resize(width);
+    hidden.resize(4 * width);
+    attn_logits.resize((size_t)batch * n_head * block_size);
+
+    for (int li = first_layer; li < last_layer; li++) {
+        const LayerWeights& layer = layer_views[li];
+        x_residual = x;
+        kernels->rms_norm(x.data(), batch, n_embed);
+
+        linear(layer.attn_wq, x.data(), q.data(), batch, scratch);
+        linear(layer.attn_wk, x.data(), k.data(), batch, scratch);
+        linear(layer.attn_wv, x.data(), v.data(), batch, scratch);
+
+        // append every row's key and value to its cache first: rows of a prefill
+        // share one cache and a row attends to the positions before it
+        for (int b = 0; b < batch; b++)
+            caches[b]->store(li, pos_ids[b], k.data() + (size_t)b * n_embed, v.data() + (size_t)b * n_embed);
+
+        // attention is per row, each one against its own sequence's KV cache, and
+        // only reads the caches. tasks are ranges of (row, head) pairs, each with
+        // its own scores, writing its heads' slices of the row's output. a task
+        // gets enough heads for ~32k multiply-adds at the longest sequence, and
+        // rows it covers whole take the per-row kernel
+        parallel_for(0, batch * n_head, grain_size((size_t)2 * block_size * head_dim), [&](int first, int last) {
+            for (int i = first; i < last;) {
+                const int b = i / n_head, h = i % n_head;
+                const float* qb = q.data() + (size_t)b * n_embed;
+                float* out = x_attn.data() + (size_t)b * n_embed;
+                float* scores = attn_logits.data() + (size_t)i * block_size;
+                if (h == 0 && i + n_head <= last) {
+                    kernels->attend_row(*caches[b], li, qb, pos_ids[b] + 1, scores, out);
+                    i += n_head;
+                } else {
+                    kernels->attend_head(*caches[b], li, h, qb, pos_ids[b] + 1, scores, out);
+                    i++;
+                }
+            }
+        });
+
+        linear(layer.attn_wo, x_attn.data(), x.data(), batch, scratch);
+
+        // residual add
+        for (size_t i = 0; i < width; i++)
+            x[i] = x[i] + x_residual[i];
+        x_residual = x;
+
+        kernels->rms_norm(x.data(), batch, n_embed);
+        linear(layer.mlp_fc1, x.data(), hidden.data(), batch, scratch);
+        for (float& val : hidden)
+            val = std::max(val, 0.f);
+        linear(layer.mlp_fc2, hidden.data(), x.data(), batch, scratch);
+
+        // residual add
+        for (size_t i = 0; i < width; i++)
+            x[i] = x[i] + x_residual[i];
+    }
+}
+
+void Model::forward_hidden(const int* token_ids, const int* pos_ids, KVCache* const* caches, int batch,
+                           ForwardScratch& scratch) const {
+    std::vector<float>& x = scratch.x;
+    x.resize((size_t)batch * n_embed);
+
+    // compute embedding and its root-mean-square norm, row by row
+    for (int b = 0; b < batch; b++) {
+        const float* token_emb = wte_view.row(token_ids[b]);
+        const float* pos_emb = wpe_view.row(pos_ids[b]);
+        float* xb = x.data() + (size_t)b * n_embed;
+        for (int i = 0; i < n_embed; i++)
+            xb[i] = token_emb[i] + pos_emb[i];
+    }
+    kernels->rms_norm(x.data(), batch, n_embed);
+
+    // pages are made private up front: pipeline stages store different layers
+    // into the same page at the same time
+    for (int b = 0; b < batch; b++) {
+        caches[b]->grow(pos_ids[b] + 1);
+        caches[b]->unshare(pos_ids[b]);
+    }
+
+    if (pipeline_stages > 1 && batch > 1)
+        forward_pipelined(pos_ids, caches, batch, scratch);
+    else
+        forward_layers(0, n_layer, pos_ids, caches, batch, scratch);
+
+    for (int b = 0; b < batch; b++)
+        caches[b]->length = std::max(caches[b]->length, pos_ids[b] + 1);
+}
+
+// GPipe-style pipeline over the layers: stage s runs layers [s * n_layer / stages,
+// (s + 1) * n_layer / stages), and the batch is cut into micro-batches of
+// consecutive rows. in tick t stage s works on micro-batch t - s, so once the
+// pipeline is full every stage is busy with another micro-batch. a micro-batch
+// reaches a layer after all earlier ones, which is all a prefill needs, and
+// every row is computed exactly as in one pass over all layers
+void Model::forward_pipelined(const int* pos_ids, KVCache* const* caches, int batch, ForwardScratch& scratch) const {
+    const int stages = pipeline_stages;
+    // four micro-batches per stage keep the bubble at (stages - 1) / (5 * stages - 1)
+    const int micro_batches = std::min(batch, 4 * stages);
+    auto first_row = [&](int m) { return (int)((long)m * batch / micro_batches); };
+    std::vector<ForwardScratch>& micro = scratch.micro_batches;
+    if ((int)micro.size() < micro_batches)
+        micro.resize(micro_batches);
+    for (int m = 0; m < micro_batches; m++)
+        micro[m].x.assign(scratch.x.begin() + (size_t)first_row(m) * n_embed, scratch.x.begin() + (size_t)first_row(m + 1) * n_embed);
+
+    std::vector<double> busy_ms(stages, 0.);
+    const int ticks = micro_batches + stages - 1;
+    auto start = std::chrono::steady_clock::now();
+    for (int tick = 0; tick < ticks; tick++) {
+        // stages with a micro-batch in this tick
+        const int first_stage = std::max(0, tick - micro_batches + 1), last_stage = std::min(stages, tick + 1);
+        parallel_for(first_stage, last_stage, 1, [&](int first, int last) {
+            for (int s = first; s < last; s++) {
+                const int m = tick - s, row = first_row(m);
+                auto stage_start = std::chrono::steady_clock::now();
+                forward_layers(s * n_layer / stages, (s + 1) * n_layer / stages, pos_ids + row, caches + row,
+                               first_row(m + 1) - row, micro[m]);
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - stage_start;
+                busy_ms[s] += elapsed.count();
+            }
+        });
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    for (int m = 0; m < micro_batches; m++)
+        std::copy(micro[m].x.begin(), micro[m].x.end(), scratch.x.begin() + (size_t)first_row(m) * n_embed);
+
+    std::lock_guard<std::mutex> lock(pipeline_mutex);
+    pipeline_totals.passes++;
+    pipeline_totals.micro_batches += micro_batches;
+    pipeline_totals.ticks += ticks;
+    pipeline_totals.slots += (uint64_t)ticks * stages;
+    pipeline_totals.busy_slots += (uint64_t)micro_batches * stages;
+    for (double ms : busy_ms)
+        pipeline_totals.busy_ms += ms;
+    pipeline_totals.stage_ms += elapsed.count() * stages;
+}
+
+std::vector<float>& Model::forward_batch(const int* token_ids, const int* pos_ids, KVCache* const* caches, int batch,
+                                         ForwardScratch& scratch) const {
+    forward_hidden(token_ids, pos_ids, caches, batch, scratch);
+    std::vector<float>& logits = scratch.logits;
+    logits.resize((size_t)batch * vocab_size);
+    linear(lm_head_weights, scratch.x.data(), logits.data(), batch, scratch);
+    return logits;
+}
+
+std::vector<float>& Model::prefill(const int* token_ids, int n, KVCache& cache, ForwardScratch& scratch) const {
+    if (n < 1 || cache.length + n > block_size)
+        throw std::runtime_error("Error: prompt of " + std::to_string(n) + " tokens does not fit into block_size " + std::to_string(block_size) + ".");
+    // every prompt position is a row of one batch over the same cache
+    scratch.pos_ids.resize(n);
+    scratch.caches.assign(n, &cache);
+    for (int i = 0; i < n; i++)
+        scratch.pos_ids[i] = cache.length + i;
+    forward_hidden(token_ids, scratch.pos_ids.data(), scratch.caches.data(), n, scratch);
+
+    // only the last position predicts the next token
+    std::vector<float>& logits = scratch.logits;
+    logits.resize(vocab_size);
+    linear(lm_head_weights, scratch.x.data() + (size_t)(n - 1) * n_embed, logits.data(), 1, scratch);
+    return logits;
+}
+
+std::vector<float>& Model::start(const std::vector<int>& path, KVCache& cache, ForwardScratch& scratch,
+                                 PrefixCache* prefix_cache, std::vector<block_t>& blocks) const {
+    cache.clear();
+    blocks.clear();
+    const size_t cached = prefix_cache ? prefix_cache->match(path, blocks) : 0;
+    for (const block_t& block : blocks)
+        prefix_cache->restore(*block, cache);
+    if (cached == path.size()) {
+        scratch.logits.assign(blocks.back()->logits.begin(), blocks.back()->logits.end());
+        return scratch.logits;
+    }
+
+    prefill(path.data() + cached, path.size() - cached, cache, scratch);
+    if (prefix_cache) {
+        for (size_t pos = cached; pos < path.size(); pos++)
+            blocks.push_back(prefix_cache->capture(cache, pos, pos + 1 == path.size() ? scratch.logits.data() : nullptr, vocab_size));
+        prefix_cache->insert(path, blocks);
+    }
+    return scratch.logits;
+}
@@ -3,7 +3,94 @@
 
 #include <random>
 #include <map>
+#include <memory>
+#include <mutex>
 #include "value.hpp"
+#include "checkpoint.hpp"
+#include "weights.hpp"
+#include "quant.hpp"
+#include "kv_cache.hpp"
+#include "kernels.hpp"
+
+// activations of one (batched) forward pass, reused across calls to avoid allocations.
+// every buffer holds one row per sequence of the batch
+struct ForwardScratch {
+    std::vector<float> x, x_residual, q, k, v, x_attn, hidden, attn_logits, logits;
+    // row positions and caches of a prefill
+    std::vector<int> pos_ids;
+    std::vector<KVCache*> caches;
+    // int8 copies of the input rows of a quantized matmul
+    std::vector<int8_t> xq;
+    std::vector<float> x_scales;
+    // input rows of a Q4 or 16-bit matmul, zero-extended to whole groups or rows
+    std::vector<float> x_padded;
+    // activations of every micro-batch of a pipelined pass
+    std::vector<ForwardScratch> micro_batches;
+};
+
+// work of the layer pipeline so far. a pass cuts its batch into micro-batches
+// that go through the stages one tick at a time; of the stages x ticks slots
+// the busy ones ran a micro-batch, the others are the pipeline bubble
+struct PipelineStats {
+    int stages = 1;
+    uint64_t passes = 0;
+    uint64_t micro_batches = 0;
+    uint64_t ticks = 0;
+    uint64_t slots = 0;
+    uint64_t busy_slots = 0;
+    // time the stages computed, and wall time of the passes times the stages
+    double busy_ms = 0.;
+    double stage_ms = 0.;
+
+    double bubble() const { return slots ? 1. - (double)busy_slots / slots : 0.; }
+    double idle() const { return stage_ms > 0. ? 1. - busy_ms / stage_ms : 0.; }
+};
+void print_pipeline_stats(const PipelineStats& stats);
+
+// storage format of the linear layer weights on the inference path,
+// the embedding tables always stay f32
+enum class Precision { F32, Int8, Q4, F16, BF16 };
+Precision parse_precision(const std::string& name);
+const char* precision_name(Precision precision);
+
+// one weight matrix of a linear layer: the f32 view, plus a copy in the
+// selected lower precision format. weight files exported as Q4 carry only q4
+struct LinearWeights {
+    WeightView f32;
+    Int8Matrix int8 = {};
+    Q4Matrix q4 = {};
+    HalfMatrix half = {};
+};
+
+// weights of one transformer layer
+struct LayerWeights {
+    LinearWeights attn_wq, attn_wk, attn_wv, attn_wo;
+    LinearWeights mlp_fc1, mlp_fc2;
+};
+
+// shape of a model. defaults to the original tiny model, can be read from a
+// config file of "key = value" lines (n_embed, n_head, n_layer, block_size)
+struct ModelConfig {
+    int n_embed = 16;
+    int n_head = 4;
+    int n_layer = 1;
+    int block_size = 16;
+
+    static ModelConfig read(const std::string& path);
+    // the shape a checkpoint was trained with
+    static ModelConfig of(const Checkpoint& checkpoint);
+    // set one dimension by name, false if there is no such dimension
+    bool set(const std::string& key, int value);
+    void validate() const;
+};
+
+class PrefixCache;
+struct KVBlock;
+
+// no-grad softmax over raw floats, shared by every inference path
+void softmax_inplace(float* logits, size_t n);
+// apply temperature to a row of logits in place and draw a token from it
+int sample_token(float* logits, int n, float temperature, std::default_random_engine& rng);
 
 class Model {
 private:
@@ -16,23 +103,91 @@ private:
     double dist_std_dev = 0.08;
     std::default_random_engine generator{};
     std::normal_distribution<double> distribution{dist_mean, dist_std_dev};
+
+    // flat float weights used by inference: either packed from the trainable
+    // values, or pointing straight into a mapped weight file
+    std::vector<float> packed;
+    std::shared_ptr<WeightFile> mapped;
+    WeightView wte_view, wpe_view;
+    LinearWeights lm_head_weights;
+    std::vector<LayerWeights> layer_views;
+    Precision precision = Precision::F32;
+    Precision kv_precision = Precision::F32;
+    // pages of the KV caches of every sequence, in the KV precision
+    std::shared_ptr<KVPagePool> kv_pool;
+    // f32 inner loops, specialized for this shape when it is a common one
+    const ShapeKernels* kernels;
+    // layer ranges of the inference pipeline, 1 runs all layers in one go
+    int pipeline_stages = 1;
+    mutable std::mutex pipeline_mutex;
+    mutable PipelineStats pipeline_totals;
+    void bind_views(const std::map<std::string, WeightView>& views, const std::map<std::string, Q4View>& q4_views = {});
+    void quantize_weights();
+    void linear(const LinearWeights& w, const float* x, float* y, int batch, ForwardScratch& scratch) const;
+    void forward_hidden(const int* token_ids, const int* pos_ids, KVCache* const* caches, int batch,
+                        ForwardScratch& scratch) const;
+    void forward_layers(int first_layer, int last_layer, const int* pos_ids, KVCache* const* caches, int batch,
+                        ForwardScratch& scratch) const;
+    void forward_pipelined(const int* pos_ids, KVCache* const* caches, int batch, ForwardScratch& scratch) const;
 public:
     // embedding dimension
-    int n_embed = 16;
+    int n_embed;
     // number of attention heads
-    int n_head = 4;
+    int n_head;
     // number of layers
-    int n_layer = 1;
+    int n_layer;
     // maximum sequence length
-    int block_size = 16;
+    int block_size;
     // dimension of each head
-    int head_dim = n_embed / n_head;
+    int head_dim;
+    int vocab_size;
 
     // constructor
-    Model(size_t vocab_size);
+    Model(size_t vocab_size, const ModelConfig& config = ModelConfig());
+    // inference-only model, weights are used in place from the mapped file
+    explicit Model(std::shared_ptr<WeightFile> file);
+
+    // copy weights and RNG state into a checkpoint, or restore them from one
+    void snapshot(Checkpoint& checkpoint);
+    void restore(const Checkpoint& checkpoint);
+
+    // model inference, every sample continues the prompt
+    void infer(int BOS, size_t num_samples, float temperature = .5f, const std::string& prompt = "");
 
-    // model inference
-    void infer(int BOS, size_t num_samples, float temperature = .5f);
+    // no-grad forward pass over the flat weights, appends to the KV cache.
+    // returns the logits, which live in scratch until its next use
+    std::vector<float>& forward(int token_id, int pos_id, KVCache& cache, ForwardScratch& scratch) const;
+    // one decode step for a batch of independent sequences: rows of the weight
+    // matrices are shared by the whole batch, attention runs against each
+    // sequence's own cache. returns batch rows of vocab_size logits
+    std::vector<float>& forward_batch(const int* token_ids, const int* pos_ids, KVCache* const* caches, int batch,
+                                      ForwardScratch& scratch) const;
+    // all n prompt tokens at once, from position cache.length on. their keys and
+    // values go into the cache, only the last position goes through lm_head.
+    // returns one row of logits
+    std::vector<float>& prefill(const int* token_ids, int n, KVCache& cache, ForwardScratch& scratch) const;
+    // begin a sequence at path (BOS and the prompt): the longest prefix found in the
+    // prefix cache is copied, the rest is prefilled and cached. blocks receives the
+    // cache blocks of every position. returns the logits of the last position
+    std::vector<float>& start(const std::vector<int>& path, KVCache& cache, ForwardScratch& scratch,
+                              PrefixCache* prefix_cache, std::vector<std::shared_ptr<const KVBlock>>& blocks) const;
+    // copy the trainable values into the flat inference weights
+    void pack_weights();
+    // run the linear layers of the inference path in another format, quantized from the f32 weights
+    void set_precision(Precision precision);
+    Precision get_precision() const { return precision; }
+    // bytes of the linear layer weights in the current format
+    size_t linear_bytes() const;
+    // store the KV caches of new sequences as f32 or int8
+    void set_kv_precision(Precision precision);
+    Precision get_kv_precision() const { return kv_precision; }
+    // empty KV cache for one sequence, paged from the model's pool
+    KVCache make_cache() const;
+    KVPoolStats kv_stats() const { return kv_pool->stats(); }
+    // split the layers into stages that batched passes run as a pipeline of micro-batches
+    void set_pipeline_stages(int stages);
+    int get_pipeline_stages() const { return pipeline_stages; }
+    PipelineStats pipeline_stats() const;
 
     // model definition related functions
     matrix_t initialize_matrix(int n_out, int n_in);
@@ -42,6 +197,10 @@ public:
     vector_t rms_norm(vector_t& x);
     vector_t gpt_old(int token_id, int pos_id, std::vector<matrix_t>& keys, std::vector<matrix_t>& values);
     vector_t gpt(int token_id, int pos_id, std::vector<matrix_t>& keys, std::vector<matrix_t>& values);
+    vector_t gpt(vector_t x, std::vector<matrix_t>& keys, std::vector<matrix_t>& values);
+    // token plus position embedding, the input of gpt
+    vector_t embed(int token_id, int pos_id);
+    const vector_t& token_embedding(int token_id);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,217 @@
+#include "prefix_cache.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+PrefixCache::PrefixCache(int n_layer, int n_embed, size_t budget_bytes)
+    : n_layer(n_layer), n_embed(n_embed), budget(budget_bytes) {}
+
+// longest cached prefix of path. its blocks are appended to blocks unless that is
+// null, last receives the block of its final position
+size_t PrefixCache::walk(const std::vector<int>& path, std::vector<block_t>* blocks, block_t& last) {
+    const uint64_t now = ++clock;
+
+    Node* node = &root;
+    size_t matched = 0;
+    while (matched < path.size()) {
+        node->last_used = now;
+        auto child = node->children.find(path[matched]);
+        if (child == node->children.end())
+            break;
+        Node* next = child->second.get();
+        next->last_used = now;
+        // walk the edge as far as it agrees with path
+        size_t i = 0;
+        while (i < next->tokens.size() && matched < path.size() && next->tokens[i] == path[matched]) {
+            if (blocks)
+                blocks->push_back(next->blocks[i]);
+            last = next->blocks[i];
+            i++;
+            matched++;
+        }
+        if (i < next->tokens.size())
+            break;
+        node = next;
+    }
+    // the last position of path is only useful with the logits to sample from
+    if (matched == path.size() && matched > 0 && last->logits.empty()) {
+        if (blocks)
+            blocks->pop_back();
+        last = nullptr;
+        matched--;
+    }
+    return matched;
+}
+
+block_t PrefixCache::lookup(const std::vector<int>& path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    block_t last;
+    const size_t matched = walk(path, nullptr, last);
+    counters.lookups++;
+    if (matched == 0 || matched < path.size())
+        return nullptr;
+    counters.hits++;
+    return last;
+}
+
+size_t PrefixCache::match(const std::vector<int>& path, std::vector<block_t>& blocks) {
+    std::lock_guard<std::mutex> lock(mutex);
+    block_t last;
+    blocks.clear();
+    const size_t matched = walk(path, &blocks, last);
+    counters.lookups += path.size();
+    counters.hits += matched;
+    return matched;
+}
+
+void PrefixCache::insert(const std::vector<int>& path, const std::vector<block_t>& blocks) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const uint64_t now = ++clock;
+
+    Node* node = &root;
+    size_t matched = 0;
+    while (matched < path.size()) {
+        node->last_used = now;
+        auto child = node->children.find(path[matched]);
+        if (child == node->children.end()) {
+            // new leaf holding the rest of the path
+            auto leaf = std::make_unique<Node>();
+            leaf->tokens.assign(path.begin() + matched, path.end());
+            leaf->blocks.assign(blocks.begin() + matched, blocks.end());
+            leaf->parent = node;
+            leaf->last_used = now;
+            for (const block_t& block : leaf->blocks)
+                counters.bytes += block->bytes();
+            node->children[path[matched]] = std::move(leaf);
+            break;
+        }
+
+        Node* next = child->second.get();
+        size_t i = 0;
+        while (i < next->tokens.size() && matched < path.size() && next->tokens[i] == path[matched]) {
+            // a prefilled position gains the logits it was cached without
+            if (next->blocks[i]->logits.empty() && !blocks[matched]->logits.empty()) {
+                counters.bytes += blocks[matched]->bytes() - next->blocks[i]->bytes();
+                next->blocks[i] = blocks[matched];
+            }
+            i++;
+            matched++;
+        }
+        if (i < next->tokens.size()) {
+            // diverged (or ended) inside the edge: split it at i
+            auto head = std::make_unique<Node>();
+            head->tokens.assign(next->tokens.begin(), next->tokens.begin() + i);
+            head->blocks.assign(next->blocks.begin(), next->blocks.begin() + i);
+            head->parent = node;
+            head->last_used = now;
+            next->tokens.erase(next->tokens.begin(), next->tokens.begin() + i);
+            next->blocks.erase(next->blocks.begin(), next->blocks.begin() + i);
+            next->parent = head.get();
+            head->children[next->tokens[0]] = std::move(child->second);
+            Node* head_raw = head.get();
+            child->second = std::move(head);
+            next = head_raw;
+        }
+        node = next;
+    }
+    node->last_used = now;
+
+    if (counters.bytes > budget)
+        evict();
+}
+
+// drop least recently used leaves until the budget holds again. leaves whose
+// blocks are referenced outside of the tree are in use and skipped.
+void PrefixCache::evict() {
+    std::vector<Node*> leaves;
+    std::vector<Node*> stack{&root};
+    while (!stack.empty()) {
+        Node* node = stack.back();
+        stack.pop_back();
+        if (node != &root && node->children.empty())
+            leaves.push_back(node);
+        for (auto& [token, child] : node->children)
+            stack.push_back(child.get());
+    }
+    std::sort(leaves.begin(), leaves.end(), [](Node* a, Node* b) { return a->last_used < b->last_used; });
+
+    for (Node* leaf : leaves) {
+        if (counters.bytes <= budget)
+            break;
+        bool in_use = std::any_of(leaf->blocks.begin(), leaf->blocks.end(), [](const block_t& b) { return b.use_count() > 1; });
+        if (in_use)
+            continue;
+        for (const block_t& block : leaf->blocks)
+            counters.bytes -= block->bytes();
+        counters.evicted += leaf->blocks.size();
+        // parents that become leaves are picked up by the next eviction round
+        leaf->parent->children.erase(leaf->tokens[0]);
+    }
+}
+
+block_t PrefixCache::capture(const KVCache& cache, int pos, const float* logits, int vocab_size) const {
+    auto block = std::make_shared<KVBlock>();
+    const float* page = cache.page(pos / cache.page_size());
+    const int slot = pos % cache.page_size();
+    if (!cache.quantized()) {
+        block->keys.resize((size_t)n_layer * n_embed);
+        block->values.resize((size_t)n_layer * n_embed);
+        for (int li = 0; li < n_layer; li++) {
+            std::copy_n(page + cache.offset(li, 0, slot, n_embed), n_embed, block->keys.data() + (size_t)li * n_embed);
+            std::copy_n(page + cache.offset(li, 1, slot, n_embed), n_embed, block->values.data() + (size_t)li * n_embed);
+        }
+    } else {
+        const int n_head = cache.n_head();
+        const int8_t* rows = cache.quantized_rows(page);
+        block->keys_q.resize((size_t)n_layer * n_embed);
+        block->values_q.resize((size_t)n_layer * n_embed);
+        block->key_scales.resize((size_t)n_layer * n_head);
+        block->value_scales.resize((size_t)n_layer * n_head);
+        for (int li = 0; li < n_layer; li++) {
+            std::copy_n(rows + cache.offset(li, 0, slot, n_embed), n_embed, block->keys_q.data() + (size_t)li * n_embed);
+            std::copy_n(rows + cache.offset(li, 1, slot, n_embed), n_embed, block->values_q.data() + (size_t)li * n_embed);
+            std::copy_n(page + cache.offset(li, 0, slot, n_head), n_head, block->key_scales.data() + (size_t)li * n_head);
+            std::copy_n(page + cache.offset(li, 1, slot, n_head), n_head, block->value_scales.data() + (size_t)li * n_head);
+        }
+    }
+    if (logits)
+        block->logits.assign(logits, logits + vocab_size);
+    return block;
+}
+
+void PrefixCache::restore(const KVBlock& block, KVCache& cache) const {
+    if (block.keys_q.empty() == cache.quantized())
+        throw std::runtime_error("Error: cached block does not match the precision of the KV cache.");
+    const int pos = cache.length;
+    cache.grow(pos + 1);
+    for (int li = 0; li < n_layer; li++) {
+        if (!cache.quantized()) {
+            cache.store(li, pos, block.keys.data() + (size_t)li * n_embed, block.values.data() + (size_t)li * n_embed);
+        } else {
+            const int n_head = cache.n_head();
+            cache.store_quantized(li, pos, block.keys_q.data() + (size_t)li * n_embed, block.values_q.data() + (size_t)li * n_embed,
+                                  block.key_scales.data() + (size_t)li * n_head, block.value_scales.data() + (size_t)li * n_head);
+        }
+    }
+    cache.length++;
+}
+
+void PrefixCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    // sequences still holding blocks keep them alive
+    root.children.clear();
+    counters.bytes = 0;
+}
+
+PrefixCacheStats PrefixCache::stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+void PrefixCache::print_stats() {
+    PrefixCacheStats s = stats();
+    std::cout << "Prefix cache: " << s.hits << " / " << s.lookups << " positions served from cache ("
+              << std::fixed << std::setprecision(1) << (s.lookups ? 100. * s.hits / s.lookups : 0.) << std::defaultfloat
+              << "% of forward passes saved), " << s.bytes << " bytes cached, " << s.evicted << " positions evicted" << std::endl;
+}
@@ -0,0 +1,90 @@
+#ifndef __PREFIX_CACHE_HPP__
+#define __PREFIX_CACHE_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "model.hpp"
+
+// everything the model computed for one position of a token prefix: its key
+// and value rows for every layer, and the output logits (before temperature).
+// prefilled prompt positions other than the last carry no logits. keys and
+// values are kept in the format of the cache they came from
+struct KVBlock {
+    // f32: [layer * n_embed + i]
+    std::vector<float> keys;
+    std::vector<float> values;
+    // int8: [layer * n_embed + i], scales [layer * n_head + h]
+    std::vector<int8_t> keys_q, values_q;
+    std::vector<float> key_scales, value_scales;
+    std::vector<float> logits;
+
+    size_t bytes() const {
+        return (keys.size() + values.size() + key_scales.size() + value_scales.size() + logits.size()) * sizeof(float) +
+               keys_q.size() + values_q.size() + sizeof(KVBlock);
+    }
+};
+typedef std::shared_ptr<const KVBlock> block_t;
+
+struct PrefixCacheStats {
+    // positions looked up, and how many of them were cached
+    uint64_t lookups = 0;
+    uint64_t hits = 0;
+    uint64_t evicted = 0;
+    size_t bytes = 0;
+};
+
+// radix tree over token prefixes, edges hold one reference-counted KVBlock per
+// token. a sequence whose inputs so far are a cached path can take its position
+// from the tree instead of running the forward pass; since every sample starts
+// at BOS, at least the first position of every sample after the first is a hit.
+// least recently used leaves are evicted once the blocks exceed the memory
+// budget, but never while a sequence still holds a reference to their blocks.
+class PrefixCache {
+private:
+    struct Node {
+        std::vector<int> tokens;
+        std::vector<block_t> blocks;
+        std::map<int, std::unique_ptr<Node>> children;
+        Node* parent = nullptr;
+        uint64_t last_used = 0;
+    };
+
+    int n_layer;
+    int n_embed;
+    size_t budget;
+    uint64_t clock = 0;
+    PrefixCacheStats counters;
+    Node root;
+    std::mutex mutex;
+
+    size_t walk(const std::vector<int>& path, std::vector<block_t>* blocks, block_t& last);
+    void evict();
+public:
+    PrefixCache(int n_layer, int n_embed, size_t budget_bytes = 64 << 20);
+
+    // block of the last position of path, if the whole path is cached with logits
+    block_t lookup(const std::vector<int>& path);
+    // blocks of the longest cached prefix of path, returns its length. the last
+    // position of path only counts if it was cached with logits
+    size_t match(const std::vector<int>& path, std::vector<block_t>& blocks);
+    // cache a path, blocks[i] belongs to path[i]. already cached positions are
+    // kept, unless they lack the logits the new block has
+    void insert(const std::vector<int>& path, const std::vector<block_t>& blocks);
+
+    // copy position pos of a KV cache (plus its logits, if any) into a new block
+    block_t capture(const KVCache& cache, int pos, const float* logits, int vocab_size) const;
+    // append a cached position to a KV cache of the same precision
+    void restore(const KVBlock& block, KVCache& cache) const;
+    // drop every cached block, e.g. when the precision changes
+    void clear();
+
+    PrefixCacheStats stats();
+    void print_stats();
+};
+
+#endif
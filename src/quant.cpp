@@ -0,0 +1,410 @@
+#include "quant.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MICROGPT_X86
+#endif
+
+static int padded(int cols) {
+    return (cols + 15) / 16 * 16;
+}
+
+// absmax scaling to [-127, 127]; -128 is never produced, which keeps the
+// pairwise int16 sums of vpmaddubsw clear of saturation
+float quantize_row(const float* x, int cols, int8_t* q) {
+    float absmax = 0.f;
+    for (int c = 0; c < cols; c++)
+        absmax = std::max(absmax, std::fabs(x[c]));
+    const float scale = absmax / 127.f;
+    const float inv_scale = absmax > 0.f ? 127.f / absmax : 0.f;
+    for (int c = 0; c < cols; c++)
+        q[c] = (int8_t)std::lround(x[c] * inv_scale);
+    return scale;
+}
+
+Int8Matrix Int8Matrix::quantize(const WeightView& w) {
+    Int8Matrix q;
+    q.rows = w.rows;
+    q.cols = w.cols;
+    q.stride = padded(w.cols);
+    q.data.assign((size_t)q.rows * q.stride, 0);
+    q.scales.resize(q.rows);
+    for (int r = 0; r < q.rows; r++)
+        q.scales[r] = quantize_row(w.row(r), w.cols, q.data.data() + (size_t)r * q.stride);
+    return q;
+}
+
+void quantize_rows(const float* x, int batch, int cols, int stride, int8_t* xq, float* scales) {
+    for (int b = 0; b < batch; b++) {
+        int8_t* row = xq + (size_t)b * stride;
+        scales[b] = quantize_row(x + (size_t)b * cols, cols, row);
+        std::fill(row + cols, row + stride, 0);
+    }
+}
+
+static int32_t dot_scalar(const int8_t* a, const int8_t* b, int n) {
+    int32_t acc = 0;
+    for (int i = 0; i < n; i++)
+        acc += (int32_t)a[i] * b[i];
+    return acc;
+}
+
+#ifdef MICROGPT_X86
+// vpmaddubsw multiplies unsigned by signed bytes: move the sign of a onto b
+// and use |a|, the products stay the same
+__attribute__((target("avx2"))) static int32_t dot_avx2(const int8_t* a, const int8_t* b, int n) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        const __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+        const __m256i pairs = _mm256_maddubs_epi16(_mm256_sign_epi8(va, va), _mm256_sign_epi8(vb, va));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(pairs, ones));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    if (i < n) {
+        // half a register left over
+        const __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        const __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        const __m128i pairs = _mm_maddubs_epi16(_mm_sign_epi8(va, va), _mm_sign_epi8(vb, va));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(pairs, _mm256_castsi256_si128(ones)));
+    }
+    sum = _mm_hadd_epi32(sum, sum);
+    sum = _mm_hadd_epi32(sum, sum);
+    return _mm_cvtsi128_si32(sum);
+}
+
+// vpdpbusd does the multiply and the widening add into int32 in one instruction
+__attribute__((target("avx2,avxvnni"))) static int32_t dot_vnni(const int8_t* a, const int8_t* b, int n) {
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        const __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+        acc = _mm256_dpbusd_avx_epi32(acc, _mm256_sign_epi8(va, va), _mm256_sign_epi8(vb, va));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    if (i < n) {
+        const __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        const __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        sum = _mm_dpbusd_avx_epi32(sum, _mm_sign_epi8(va, va), _mm_sign_epi8(vb, va));
+    }
+    sum = _mm_hadd_epi32(sum, sum);
+    sum = _mm_hadd_epi32(sum, sum);
+    return _mm_cvtsi128_si32(sum);
+}
+#endif
+
+typedef int32_t (*dot_kernel)(const int8_t*, const int8_t*, int);
+
+struct Kernel {
+    dot_kernel dot;
+    const char* name;
+};
+
+static Kernel pick_kernel() {
+#ifdef MICROGPT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avxvnni"))
+        return {dot_vnni, "avx-vnni"};
+    if (__builtin_cpu_supports("avx2"))
+        return {dot_avx2, "avx2"};
+#endif
+    return {dot_scalar, "scalar"};
+}
+
+static const Kernel kernel = pick_kernel();
+
+const char* int8_kernel_name() {
+    return kernel.name;
+}
+
+void matmul_int8(const Int8Matrix& w, const int8_t* xq, const float* x_scales, float* y, int batch) {
+    // output rows are independent, large matrices split them across the pool
+    parallel_for(0, w.rows, grain_size((size_t)w.stride * batch), [&](int first, int last) {
+        for (int r = first; r < last; r++) {
+            const int8_t* row = w.row(r);
+            for (int b = 0; b < batch; b++) {
+                const int32_t acc = kernel.dot(row, xq + (size_t)b * w.stride, w.stride);
+                y[(size_t)b * w.rows + r] = (float)acc * w.scales[r] * x_scales[b];
+            }
+        }
+    });
+}
+
+uint16_t float_to_half(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const uint16_t sign = (bits >> 16) & 0x8000;
+    const int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+    if (((bits >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    if (exponent >= 31)
+        return sign | 0x7c00;
+    if (exponent <= 0) {
+        // subnormal half, or zero
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x800000;
+        const int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            half++;
+        return sign | half;
+    }
+    uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+    const uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return sign | half;
+}
+
+float half_to_float(uint16_t half) {
+    const uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    const uint32_t exponent = (half >> 10) & 0x1f;
+    const uint32_t mantissa = half & 0x3ff;
+    uint32_t bits;
+    if (exponent == 0) {
+        const float value = std::ldexp((float)mantissa, -24);
+        return sign ? -value : value;
+    }
+    if (exponent == 31)
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    else
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+uint16_t float_to_bf16(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000)
+        return (bits >> 16) | 0x40;
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return bits >> 16;
+}
+
+float bf16_to_float(uint16_t bf16) {
+    const uint32_t bits = (uint32_t)bf16 << 16;
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+HalfMatrix HalfMatrix::convert(const WeightView& w, bool bf16) {
+    HalfMatrix h;
+    h.rows = w.rows;
+    h.cols = w.cols;
+    h.stride = (w.cols + 7) / 8 * 8;
+    h.bf16 = bf16;
+    h.data.assign((size_t)h.rows * h.stride, 0);
+    for (int r = 0; r < h.rows; r++)
+        for (int c = 0; c < h.cols; c++)
+            h.data[(size_t)r * h.stride + c] = bf16 ? float_to_bf16(w.row(r)[c]) : float_to_half(w.row(r)[c]);
+    return h;
+}
+
+static float dot_f16_scalar(const uint16_t* w, const float* x, int n) {
+    float acc = 0.f;
+    for (int i = 0; i < n; i++)
+        acc += half_to_float(w[i]) * x[i];
+    return acc;
+}
+
+static float dot_bf16_scalar(const uint16_t* w, const float* x, int n) {
+    float acc = 0.f;
+    for (int i = 0; i < n; i++)
+        acc += bf16_to_float(w[i]) * x[i];
+    return acc;
+}
+
+#ifdef MICROGPT_X86
+__attribute__((target("avx2,fma"))) static float hsum_avx2(__m256 acc) {
+    __m128 total = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    total = _mm_hadd_ps(total, total);
+    total = _mm_hadd_ps(total, total);
+    return _mm_cvtss_f32(total);
+}
+
+// vcvtph2ps widens 8 halves at a time
+__attribute__((target("avx2,fma,f16c"))) static float dot_f16_avx2(const uint16_t* w, const float* x, int n) {
+    __m256 acc = _mm256_setzero_ps();
+    for (int i = 0; i < n; i += 8) {
+        const __m256 wf = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(w + i)));
+        acc = _mm256_fmadd_ps(wf, _mm256_loadu_ps(x + i), acc);
+    }
+    return hsum_avx2(acc);
+}
+
+// a bfloat16 is the upper half of an f32: zero-extend and shift into place
+__attribute__((target("avx2,fma"))) static float dot_bf16_avx2(const uint16_t* w, const float* x, int n) {
+    __m256 acc = _mm256_setzero_ps();
+    for (int i = 0; i < n; i += 8) {
+        const __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(w + i)));
+        const __m256 wf = _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16));
+        acc = _mm256_fmadd_ps(wf, _mm256_loadu_ps(x + i), acc);
+    }
+    return hsum_avx2(acc);
+}
+#endif
+
+typedef float (*half_kernel)(const uint16_t*, const float*, int);
+
+struct HalfKernel {
+    half_kernel dot;
+    const char* name;
+};
+
+static HalfKernel pick_half_kernel(bool bf16) {
+#ifdef MICROGPT_X86
+    __builtin_cpu_init();
+    const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if (bf16 && avx2)
+        return {dot_bf16_avx2, "avx2"};
+    if (!bf16 && avx2 && __builtin_cpu_supports("f16c"))
+        return {dot_f16_avx2, "avx2+f16c"};
+#endif
+    return {bf16 ? dot_bf16_scalar : dot_f16_scalar, "scalar"};
+}
+
+static const HalfKernel f16 = pick_half_kernel(false);
+static const HalfKernel bf16 = pick_half_kernel(true);
+
+const char* half_kernel_name(bool is_bf16) {
+    return is_bf16 ? bf16.name : f16.name;
+}
+
+void matmul_half(const HalfMatrix& w, const float* x, float* y, int batch, std::vector<float>& padded) {
+    const HalfKernel& kernel = w.bf16 ? bf16 : f16;
+    padded.assign((size_t)batch * w.stride, 0.f);
+    for (int b = 0; b < batch; b++)
+        std::copy_n(x + (size_t)b * w.cols, w.cols, padded.data() + (size_t)b * w.stride);
+    parallel_for(0, w.rows, grain_size((size_t)w.stride * batch), [&](int first, int last) {
+        for (int r = first; r < last; r++) {
+            const uint16_t* row = w.row(r);
+            for (int b = 0; b < batch; b++)
+                y[(size_t)b * w.rows + r] = kernel.dot(row, padded.data() + (size_t)b * w.stride, w.stride);
+        }
+    });
+}
+
+std::vector<Q4Block> quantize_q4(const float* data, int rows, int cols) {
+    const int groups = (cols + 31) / 32;
+    std::vector<Q4Block> blocks((size_t)rows * groups);
+    for (int r = 0; r < rows; r++) {
+        for (int g = 0; g < groups; g++) {
+            float group[32] = {};
+            const int n = std::min(32, cols - g * 32);
+            std::copy_n(data + (size_t)r * cols + g * 32, n, group);
+
+            float absmax = 0.f;
+            for (float value : group)
+                absmax = std::max(absmax, std::fabs(value));
+            // symmetric -7..7, quantized against the scale as it is stored
+            Q4Block& block = blocks[(size_t)r * groups + g];
+            block.scale = float_to_half(absmax / 7.f);
+            const float scale = half_to_float(block.scale);
+            const float inv_scale = scale > 0.f ? 1.f / scale : 0.f;
+            uint8_t nibbles[32];
+            for (int i = 0; i < 32; i++)
+                nibbles[i] = (uint8_t)std::clamp((int)std::lround(group[i] * inv_scale) + 8, 0, 15);
+            for (int i = 0; i < 16; i++)
+                block.qs[i] = nibbles[i] | (nibbles[i + 16] << 4);
+        }
+    }
+    return blocks;
+}
+
+Q4Matrix Q4Matrix::quantize(const WeightView& w) {
+    Q4Matrix q;
+    auto storage = std::make_shared<std::vector<Q4Block>>(quantize_q4(w.data, w.rows, w.cols));
+    q.view = Q4View{storage->data(), w.rows, w.cols, (w.cols + 31) / 32};
+    q.storage = std::move(storage);
+    return q;
+}
+
+static float dot_q4_scalar(const Q4Block* blocks, int groups, const float* x) {
+    float acc = 0.f;
+    for (int g = 0; g < groups; g++) {
+        const Q4Block& block = blocks[g];
+        const float* xg = x + g * 32;
+        float sum = 0.f;
+        for (int i = 0; i < 16; i++) {
+            sum += (float)((block.qs[i] & 0x0f) - 8) * xg[i];
+            sum += (float)((block.qs[i] >> 4) - 8) * xg[i + 16];
+        }
+        acc += sum * half_to_float(block.scale);
+    }
+    return acc;
+}
+
+#ifdef MICROGPT_X86
+// expand 32 nibbles to four registers of 8 floats and fma them against x
+__attribute__((target("avx2,fma"))) static float dot_q4_avx2(const Q4Block* blocks, int groups, const float* x) {
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i eight = _mm_set1_epi8(8);
+    __m256 acc = _mm256_setzero_ps();
+    for (int g = 0; g < groups; g++) {
+        const Q4Block& block = blocks[g];
+        const float* xg = x + g * 32;
+        const __m128i raw = _mm_loadu_si128((const __m128i*)block.qs);
+        const __m128i lo = _mm_sub_epi8(_mm_and_si128(raw, mask), eight);
+        const __m128i hi = _mm_sub_epi8(_mm_and_si128(_mm_srli_epi16(raw, 4), mask), eight);
+        __m256 sum = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(lo)), _mm256_loadu_ps(xg));
+        sum = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(lo, 8))), _mm256_loadu_ps(xg + 8), sum);
+        sum = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(hi)), _mm256_loadu_ps(xg + 16), sum);
+        sum = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(hi, 8))), _mm256_loadu_ps(xg + 24), sum);
+        acc = _mm256_fmadd_ps(sum, _mm256_set1_ps(half_to_float(block.scale)), acc);
+    }
+    __m128 total = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    total = _mm_hadd_ps(total, total);
+    total = _mm_hadd_ps(total, total);
+    return _mm_cvtss_f32(total);
+}
+#endif
+
+typedef float (*q4_kernel)(const Q4Block*, int, const float*);
+
+struct Q4Kernel {
+    q4_kernel dot;
+    const char* name;
+};
+
+static Q4Kernel pick_q4_kernel() {
+#ifdef MICROGPT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return {dot_q4_avx2, "avx2"};
+#endif
+    return {dot_q4_scalar, "scalar"};
+}
+
+static const Q4Kernel q4 = pick_q4_kernel();
+
+const char* q4_kernel_name() {
+    return q4.name;
+}
+
+void matmul_q4(const Q4View& w, const float* x, float* y, int batch, std::vector<float>& padded) {
+    const size_t stride = (size_t)w.groups * 32;
+    padded.assign(batch * stride, 0.f);
+    for (int b = 0; b < batch; b++)
+        std::copy_n(x + (size_t)b * w.cols, w.cols, padded.data() + b * stride);
+    parallel_for(0, w.rows, grain_size(stride * batch), [&](int first, int last) {
+        for (int r = first; r < last; r++) {
+            const Q4Block* row = w.row(r);
+            for (int b = 0; b < batch; b++)
+                y[(size_t)b * w.rows + r] = q4.dot(row, w.groups, padded.data() + b * stride);
+        }
+    });
+}
@@ -0,0 +1,88 @@
+#ifndef __QUANT_HPP__
+#define __QUANT_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "weights.hpp"
+
+// symmetric per-row int8 copy of a weight matrix: row r is scales[r] * data[r].
+// rows are zero-padded to a multiple of 16 so kernels never need a scalar tail
+struct Int8Matrix {
+    std::vector<int8_t> data;
+    std::vector<float> scales;
+    int rows = 0;
+    int cols = 0;
+    int stride = 0;
+
+    static Int8Matrix quantize(const WeightView& w);
+    const int8_t* row(int r) const { return data.data() + (size_t)r * stride; }
+    size_t bytes() const { return data.size() + scales.size() * sizeof(float); }
+};
+
+// absmax int8 quantization of n values to [-127, 127], returns the scale
+float quantize_row(const float* x, int n, int8_t* q);
+
+// quantize batch rows of cols activations to int8 the same way, one scale per row
+void quantize_rows(const float* x, int batch, int cols, int stride, int8_t* xq, float* scales);
+
+// y[b][r] = w.row(r) . x[b] for int8 activations from quantize_rows, int32
+// accumulation. uses AVX-VNNI or AVX2 when the CPU has them, portable code otherwise
+void matmul_int8(const Int8Matrix& w, const int8_t* xq, const float* x_scales, float* y, int batch);
+
+// name of the int8 dot kernel picked for this CPU
+const char* int8_kernel_name();
+
+// IEEE half precision conversions, round to nearest even
+uint16_t float_to_half(float value);
+float half_to_float(uint16_t half);
+
+// bfloat16: the upper half of an f32, round to nearest even
+uint16_t float_to_bf16(float value);
+float bf16_to_float(uint16_t bf16);
+
+// 16-bit copy of a weight matrix, IEEE half or bfloat16. rows are zero-padded
+// to a multiple of 8 so the kernels convert whole registers
+struct HalfMatrix {
+    std::vector<uint16_t> data;
+    int rows = 0;
+    int cols = 0;
+    int stride = 0;
+    bool bf16 = false;
+
+    static HalfMatrix convert(const WeightView& w, bool bf16);
+    const uint16_t* row(int r) const { return data.data() + (size_t)r * stride; }
+    size_t bytes() const { return data.size() * sizeof(uint16_t); }
+};
+
+// y[b][r] = w.row(r) . x[b] with f32 activations and f32 accumulation, weights are
+// widened to f32 in registers (F16C or AVX2 where available). padded holds each x
+// row zero-extended to the row stride
+void matmul_half(const HalfMatrix& w, const float* x, float* y, int batch, std::vector<float>& padded);
+
+// name of the f16 or bf16 kernel picked for this CPU
+const char* half_kernel_name(bool bf16);
+
+// rows x cols floats as Q4 groups, see Q4Block
+std::vector<Q4Block> quantize_q4(const float* data, int rows, int cols);
+
+// a Q4 matrix, either quantized here (and owned) or pointing into a mapped weight file
+struct Q4Matrix {
+    Q4View view;
+    std::shared_ptr<const std::vector<Q4Block>> storage;
+
+    static Q4Matrix quantize(const WeightView& w);
+    size_t bytes() const { return (size_t)view.rows * view.groups * sizeof(Q4Block); }
+};
+
+// y[b][r] = w.row(r) . x[b] with f32 activations. weights are expanded group by
+// group in registers (AVX2/FMA where available), never into a full precision
+// copy. padded holds each x row zero-extended to whole groups
+void matmul_q4(const Q4View& w, const float* x, float* y, int batch, std::vector<float>& padded);
+
+// name of the Q4 kernel picked for this CPU
+const char* q4_kernel_name();
+
+#endif
@@ -0,0 +1,302 @@
+#include "scheduler.hpp"
+#include "data_loader.hpp"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+bool TokenStream::try_push(const StreamEvent& event) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (closed || events.size() >= capacity)
+            return false;
+        events.push_back(event);
+        if (event.finished)
+            unfinished--;
+    }
+    cv.notify_one();
+    return true;
+}
+
+bool TokenStream::pop(StreamEvent& event, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!cv.wait_for(lock, timeout, [&] { return !events.empty(); }))
+        return false;
+    const bool was_full = events.size() >= capacity;
+    event = events.front();
+    events.pop_front();
+    lock.unlock();
+    // the producer may have paused sequences on this stream
+    if (was_full && on_drain)
+        on_drain();
+    return true;
+}
+
+bool TokenStream::drained() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return unfinished == 0 && events.empty();
+}
+
+void TokenStream::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+    }
+    if (on_drain)
+        on_drain();
+}
+
+bool TokenStream::is_closed() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return closed;
+}
+
+void TokenStream::fail(const std::string& message) {
+    std::lock_guard<std::mutex> lock(mutex);
+    error = message;
+}
+
+std::string TokenStream::failure() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return error;
+}
+
+Scheduler::Scheduler(const Model& model, int BOS, int max_batch)
+    : model(model), BOS(BOS), max_batch(max_batch), prefix_cache(model.n_layer, model.n_embed) {
+    // nothing would ever be admitted and the decode loop would spin
+    if (max_batch < 1)
+        throw std::runtime_error("Error: max batch must be at least 1, got " + std::to_string(max_batch) + ".");
+    worker = std::thread(&Scheduler::run, this);
+}
+
+Scheduler::~Scheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    worker.join();
+}
+
+void Scheduler::wake() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        drained = true;
+    }
+    cv.notify_one();
+}
+
+std::future<std::vector<std::string>> Scheduler::submit(const std::vector<int>& prompt, int num_samples, float temperature,
+                                                        int max_tokens, unsigned seed, std::shared_ptr<TokenStream> stream) {
+    if ((int)prompt.size() > model.block_size)
+        throw std::runtime_error("Error: prompt does not fit into block_size " + std::to_string(model.block_size) + ".");
+    auto request = std::make_shared<Request>();
+    if (stream) {
+        stream->set_on_drain([this] { wake(); });
+        request->stream = std::move(stream);
+    }
+    request->temperature = temperature;
+    request->max_tokens = std::min(max_tokens, model.block_size);
+    request->samples.resize(num_samples);
+    request->remaining = num_samples;
+    request->unstarted = num_samples;
+    auto future = request->done.get_future();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int i = 0; i < num_samples; i++) {
+            std::seed_seq seq{seed, (unsigned)i};
+            std::default_random_engine rng(seq);
+            Sequence sequence{request, i, rng, nullptr, BOS, {prompt.begin() + 1, prompt.end()}};
+            sequence.path = prompt;
+            waiting.push_back(std::move(sequence));
+        }
+    }
+    cv.notify_one();
+    return future;
+}
+
+// move waiting sequences into free batch slots, each gets a recycled KV cache
+void Scheduler::admit() {
+    while (!waiting.empty() && (int)active.size() < max_batch) {
+        // the cache first, a failed allocation leaves the sequence waiting
+        if (free_caches.empty())
+            free_caches.push_back(std::make_unique<KVCache>(model.make_cache()));
+        Sequence sequence = std::move(waiting.front());
+        waiting.pop_front();
+        sequence.cache = std::move(free_caches.back());
+        free_caches.pop_back();
+        sequence.cache->clear();
+        active.push_back(std::move(sequence));
+    }
+}
+
+void Scheduler::retire(Sequence& sequence) {
+    Request& request = *sequence.request;
+    request.samples[sequence.index] = detokenize(sequence.tokens);
+    if (--request.remaining == 0)
+        request.done.set_value(std::move(request.samples));
+    // pages go back to the pool right away, the page table is kept for reuse
+    sequence.cache->clear();
+    free_caches.push_back(std::move(sequence.cache));
+    sequence.blocks.clear();
+}
+
+// fail the requests of every running sequence: the batch they were stepped in is
+// lost. their pages go back to the pool and their waiting samples are dropped
+void Scheduler::fail(std::exception_ptr error) {
+    std::string message = "Error: generation failed.";
+    try {
+        std::rethrow_exception(error);
+    } catch (const std::exception& e) {
+        message = e.what();
+    } catch (...) {
+    }
+    std::cerr << message << std::endl;
+
+    for (Sequence& sequence : active) {
+        Request& request = *sequence.request;
+        if (!request.failed && request.remaining > 0) {
+            request.failed = true;
+            request.done.set_exception(error);
+            if (request.stream)
+                request.stream->fail(message);
+            request.prompt.clear();
+            request.prompt_blocks.clear();
+        }
+        if (sequence.cache) {
+            sequence.cache->clear();
+            free_caches.push_back(std::move(sequence.cache));
+        }
+    }
+    active.clear();
+    std::lock_guard<std::mutex> lock(mutex);
+    waiting.erase(std::remove_if(waiting.begin(), waiting.end(), [](const Sequence& s) { return s.request->failed; }), waiting.end());
+}
+
+// forward an event to the request's stream, or park it if the client is behind
+void Scheduler::emit(Sequence& sequence, const StreamEvent& event) {
+    if (!sequence.backlog.empty() || !sequence.request->stream->try_push(event))
+        sequence.backlog.push_back(event);
+}
+
+// the whole prompt in one prefill pass, or straight from the prefix cache. the
+// other samples of the request fork its pages instead of copying them
+void Scheduler::start(Sequence& sequence) {
+    Request& request = *sequence.request;
+    if (request.prompt.length > 0) {
+        *sequence.cache = request.prompt.fork();
+        sequence.blocks = request.prompt_blocks;
+        cached_logits.assign(sequence.blocks.back()->logits.begin(), sequence.blocks.back()->logits.end());
+        advance(sequence, cached_logits.data());
+    } else {
+        float* logits = model.start(sequence.path, *sequence.cache, scratch, &prefix_cache, sequence.blocks).data();
+        if (request.unstarted > 1) {
+            request.prompt = sequence.cache->fork();
+            request.prompt_blocks = sequence.blocks;
+        }
+        advance(sequence, logits);
+    }
+    // once every sample has its own page table, the request lets go of the prompt
+    if (--request.unstarted == 0) {
+        request.prompt.clear();
+        request.prompt_blocks.clear();
+    }
+}
+
+// sample the next token of a sequence from the logits of its last position
+void Scheduler::advance(Sequence& sequence, float* logits) {
+    sequence.token = sample_token(logits, model.vocab_size, sequence.request->temperature, sequence.rng);
+    if (sequence.token != BOS)
+        sequence.tokens.push_back(sequence.token);
+    sequence.finished = sequence.token == BOS || sequence.cache->length >= sequence.request->max_tokens;
+    if (sequence.request->stream) {
+        if (sequence.token != BOS)
+            emit(sequence, StreamEvent{sequence.index, sequence.token, false});
+        if (sequence.finished)
+            emit(sequence, StreamEvent{sequence.index, -1, true});
+    }
+}
+
+// one decode iteration over every runnable sequence, false if none could run
+bool Scheduler::step() {
+    // deliver parked events first, drop sequences whose client went away
+    for (Sequence& sequence : active) {
+        const std::shared_ptr<TokenStream>& stream = sequence.request->stream;
+        if (!stream)
+            continue;
+        if (stream->is_closed()) {
+            sequence.backlog.clear();
+            sequence.finished = true;
+        }
+        while (!sequence.backlog.empty() && stream->try_push(sequence.backlog.front()))
+            sequence.backlog.pop_front();
+    }
+
+    // batch everything that is neither paused nor finished, cached positions skip the forward pass
+    token_ids.clear();
+    pos_ids.clear();
+    caches.clear();
+    std::vector<Sequence*> batch;
+    bool progressed = false;
+    for (Sequence& sequence : active) {
+        if (sequence.finished || !sequence.backlog.empty())
+            continue;
+        progressed = true;
+        if (sequence.cache->length == 0) {
+            start(sequence);
+            continue;
+        }
+        sequence.path.push_back(sequence.token);
+        if (block_t block = prefix_cache.lookup(sequence.path)) {
+            prefix_cache.restore(*block, *sequence.cache);
+            cached_logits.assign(block->logits.begin(), block->logits.end());
+            sequence.blocks.push_back(std::move(block));
+            advance(sequence, cached_logits.data());
+            continue;
+        }
+        batch.push_back(&sequence);
+        token_ids.push_back(sequence.token);
+        pos_ids.push_back(sequence.cache->length);
+        caches.push_back(sequence.cache.get());
+    }
+
+    if (!batch.empty()) {
+        std::vector<float>& logits = model.forward_batch(token_ids.data(), pos_ids.data(), caches.data(), batch.size(), scratch);
+
+        for (size_t b = 0; b < batch.size(); b++) {
+            Sequence& sequence = *batch[b];
+            float* row = logits.data() + b * model.vocab_size;
+            sequence.blocks.push_back(prefix_cache.capture(*sequence.cache, pos_ids[b], row, model.vocab_size));
+            prefix_cache.insert(sequence.path, sequence.blocks);
+            advance(sequence, row);
+        }
+    }
+
+    // retire finished sequences once their stream took every event, their caches go back to the free list
+    for (Sequence& sequence : active)
+        if (sequence.finished && sequence.backlog.empty())
+            retire(sequence);
+    active.erase(std::remove_if(active.begin(), active.end(), [](const Sequence& s) { return !s.cache; }), active.end());
+    return progressed;
+}
+
+void Scheduler::run() {
+    bool progressed = true;
+    for (;;) {
+        try {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                // with every active sequence paused on a slow client, sleep until a stream drains
+                cv.wait(lock, [&] { return stop || !waiting.empty() || (!active.empty() && (progressed || drained)); });
+                if (stop)
+                    return;
+                drained = false;
+                admit();
+            }
+            progressed = step();
+        } catch (...) {
+            // an exception must not take the decode thread, and every other request, down
+            fail(std::current_exception());
+        }
+    }
+}
@@ -0,0 +1,147 @@
+#ifndef __SCHEDULER_HPP__
+#define __SCHEDULER_HPP__
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "model.hpp"
+#include "prefix_cache.hpp"
+
+// one streamed event: a sampled token, or the end of a sample
+struct StreamEvent {
+    int sample;
+    int token;
+    bool finished;
+};
+
+// bounded per-connection event buffer between the decode loop and a slow client.
+// the decode loop never blocks on it: a failed try_push pauses the sequence
+// (backpressure) until the client drains the buffer, which wakes the scheduler.
+class TokenStream {
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<StreamEvent> events;
+    size_t capacity;
+    int unfinished;
+    bool closed = false;
+    std::string error;
+    std::function<void()> on_drain;
+public:
+    TokenStream(int num_samples, size_t capacity = 64) : capacity(capacity), unfinished(num_samples) {}
+
+    // producer side, false when the buffer is full or the client went away
+    bool try_push(const StreamEvent& event);
+    // consumer side, waits up to timeout for an event
+    bool pop(StreamEvent& event, std::chrono::milliseconds timeout);
+    // every sample has finished and every event was consumed
+    bool drained();
+    // the client disconnected, remaining sequences are cancelled
+    void close();
+    bool is_closed();
+    // generation failed, the consumer reports message after the queued events
+    void fail(const std::string& message);
+    // the failure message, empty while nothing failed
+    std::string failure();
+
+    void set_on_drain(std::function<void()> callback) { on_drain = std::move(callback); }
+};
+
+// iteration-level (continuous batching) scheduler for concurrent generation.
+// a single decode loop merges the active sequences of all in-flight requests
+// into one forward_batch per step. new requests are admitted between steps and
+// finished sequences (BOS sampled or max_tokens reached) retire immediately,
+// so a long request never holds back the short ones queued behind it. positions
+// whose token prefix was computed before come from a shared prefix cache, and the
+// samples of one request share the KV pages of their prompt. a slow
+// streaming client only pauses its own sequences, never the decode loop. a step
+// that throws fails the requests of the running batch, the loop keeps serving.
+class Scheduler {
+private:
+    struct Request {
+        float temperature;
+        int max_tokens;
+        std::vector<std::string> samples;
+        int remaining;
+        std::promise<std::vector<std::string>> done;
+        // set for streaming requests, receives every token as it is sampled
+        std::shared_ptr<TokenStream> stream;
+        // the prompt's KV pages, forked into every sample after the first to start
+        KVCache prompt;
+        std::vector<block_t> prompt_blocks;
+        int unstarted;
+        // done holds the exception, the remaining sequences are dropped
+        bool failed = false;
+    };
+
+    struct Sequence {
+        std::shared_ptr<Request> request;
+        int index;
+        // seeded from (request seed, sample index), so results do not depend on batching
+        std::default_random_engine rng;
+        std::unique_ptr<KVCache> cache;
+        int token;
+        std::vector<int> tokens;
+        bool finished = false;
+        // events the stream had no room for, the sequence is paused until they are delivered
+        std::deque<StreamEvent> backlog = {};
+        // inputs fed so far and their prefix cache blocks, pinned while the sequence runs
+        std::vector<int> path = {};
+        std::vector<block_t> blocks = {};
+    };
+
+    const Model& model;
+    int BOS;
+    int max_batch;
+
+    // submitted sequences not yet admitted into the running batch
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Sequence> waiting;
+    bool stop = false;
+    // a paused stream was drained by its client
+    bool drained = false;
+
+    // owned by the decode loop only
+    std::vector<Sequence> active;
+    std::vector<std::unique_ptr<KVCache>> free_caches;
+    ForwardScratch scratch;
+    std::vector<float> cached_logits;
+    PrefixCache prefix_cache;
+    std::vector<int> token_ids, pos_ids;
+    std::vector<KVCache*> caches;
+    std::thread worker;
+
+    void run();
+    void admit();
+    bool step();
+    void start(Sequence& sequence);
+    void emit(Sequence& sequence, const StreamEvent& event);
+    void advance(Sequence& sequence, float* logits);
+    void retire(Sequence& sequence);
+    void fail(std::exception_ptr error);
+    void wake();
+public:
+    Scheduler(const Model& model, int BOS, int max_batch = 64);
+    ~Scheduler();
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // every sample continues prompt (BOS followed by the prompt tokens). stream, if
+    // given, additionally receives every generated token as soon as it is sampled
+    std::future<std::vector<std::string>> submit(const std::vector<int>& prompt, int num_samples, float temperature, int max_tokens,
+                                                 unsigned seed, std::shared_ptr<TokenStream> stream = nullptr);
+    // positions shared between sequences (and requests) are computed once
+    PrefixCacheStats prefix_stats() { return prefix_cache.stats(); }
+};
+
+#endif
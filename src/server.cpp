@@ -0,0 +1,156 @@
+#include "server.hpp"
+#include "scheduler.hpp"
+#include "data_loader.hpp"
+#include "../lib/httplib.h"
+#include <iostream>
+#include <random>
+#include <sstream>
+
+static std::string json_string(const std::string& str) {
+    std::string out = "\"";
+    for (char ch : str) {
+        if (ch == '"' || ch == '\\')
+            out.push_back('\\');
+        out.push_back(ch);
+    }
+    return out + "\"";
+}
+
+static std::string json_error(const std::string& message) {
+    return "{\"error\": " + json_string(message) + "}\n";
+}
+
+template <typename T>
+static T param(const httplib::Request& req, const std::string& key, T fallback) {
+    if (!req.has_param(key))
+        return fallback;
+    std::istringstream value(req.get_param_value(key));
+    T parsed;
+    if (!(value >> parsed) || !value.eof())
+        throw std::invalid_argument("invalid value for \"" + key + "\"");
+    return parsed;
+}
+
+struct GenerationParams {
+    int num_samples;
+    float temperature;
+    int max_tokens;
+    unsigned seed;
+    std::string prompt;
+    std::vector<int> prompt_tokens;
+};
+
+// parse and validate the shared /generate parameters, answers 400 on failure
+static bool parse_params(const httplib::Request& req, httplib::Response& res, const Model& model, int BOS, GenerationParams& params) {
+    try {
+        params.num_samples = param(req, "num_samples", 1);
+        params.temperature = param(req, "temperature", .5f);
+        params.max_tokens = param(req, "max_tokens", model.block_size);
+        params.seed = param(req, "seed", std::random_device{}());
+        params.prompt = req.get_param_value("prompt");
+        if (params.num_samples < 1 || params.num_samples > 1000 || !(params.temperature > 0.f) || params.max_tokens < 1 ||
+            (int)params.prompt.size() >= model.block_size)
+            throw std::invalid_argument("parameter out of range");
+        params.prompt_tokens = tokenize_prompt(params.prompt, BOS);
+    } catch (const std::exception& e) {
+        res.status = 400;
+        res.set_content(json_error(e.what()), "application/json");
+        return false;
+    }
+    return true;
+}
+
+void serve(const Model& model, int BOS, const std::string& host, int port, int num_threads, int max_batch) {
+    // all decoding happens in the scheduler, http workers only parse and wait
+    Scheduler scheduler(model, BOS, max_batch);
+    httplib::Server server;
+    server.new_task_queue = [num_threads] { return new httplib::ThreadPool(num_threads); };
+
+    auto generate = [&model, &scheduler, BOS](const httplib::Request& req, httplib::Response& res) {
+        GenerationParams params;
+        if (!parse_params(req, res, model, BOS, params))
+            return;
+
+        std::vector<std::string> samples;
+        try {
+            samples = scheduler.submit(params.prompt_tokens, params.num_samples, params.temperature, params.max_tokens, params.seed).get();
+        } catch (const std::exception& e) {
+            res.status = 500;
+            res.set_content(json_error(e.what()), "application/json");
+            return;
+        }
+        std::string body = "{\"samples\": [";
+        for (size_t i = 0; i < samples.size(); i++)
+            body += (i ? ", " : "") + json_string(samples[i]);
+        body += "]}\n";
+        res.set_content(body, "application/json");
+    };
+    server.Get("/generate", generate);
+    server.Post("/generate", generate);
+
+    // same parameters, tokens are pushed as server-sent events the moment they are sampled:
+    //   data: {"sample": i, "token": "a"}
+    //   data: {"sample": i, "done": true, "text": "..."}
+    //   event: end
+    // or, once generation failed, event: error with data: {"error": "..."}
+    auto generate_stream = [&model, &scheduler, BOS](const httplib::Request& req, httplib::Response& res) {
+        GenerationParams params;
+        if (!parse_params(req, res, model, BOS, params))
+            return;
+
+        auto stream = std::make_shared<TokenStream>(params.num_samples);
+        scheduler.submit(params.prompt_tokens, params.num_samples, params.temperature, params.max_tokens, params.seed, stream);
+        auto texts = std::make_shared<std::vector<std::string>>(params.num_samples, params.prompt);
+        res.set_header("Cache-Control", "no-cache");
+        res.set_chunked_content_provider(
+            "text/event-stream",
+            [stream, texts](size_t, httplib::DataSink& sink) {
+                StreamEvent event;
+                if (!stream->pop(event, std::chrono::milliseconds(100))) {
+                    const std::string error = stream->failure();
+                    if (!error.empty()) {
+                        std::string data = "event: error\ndata: " + json_error(error) + "\n";
+                        sink.write(data.data(), data.size());
+                        sink.done();
+                    } else if (stream->drained()) {
+                        std::string end = "event: end\ndata: {}\n\n";
+                        sink.write(end.data(), end.size());
+                        sink.done();
+                    }
+                    // nothing yet, keep the connection unless the client is gone
+                    return sink.is_writable();
+                }
+                std::string data = "data: {\"sample\": " + std::to_string(event.sample) + ", ";
+                if (event.finished) {
+                    data += "\"done\": true, \"text\": " + json_string((*texts)[event.sample]) + "}\n\n";
+                } else {
+                    (*texts)[event.sample].push_back((char)('a' + event.token));
+                    data += "\"token\": " + json_string(std::string(1, (char)('a' + event.token))) + "}\n\n";
+                }
+                return sink.write(data.data(), data.size());
+            },
+            [stream](bool) { stream->close(); });
+    };
+    server.Get("/generate_stream", generate_stream);
+
+    // prefix cache effectiveness over the lifetime of the server, KV page usage and the layer pipeline
+    server.Get("/stats", [&scheduler, &model](const httplib::Request&, httplib::Response& res) {
+        PrefixCacheStats stats = scheduler.prefix_stats();
+        KVPoolStats pages = model.kv_stats();
+        PipelineStats pipeline = model.pipeline_stats();
+        std::ostringstream body;
+        body << "{\"prefix_cache\": {\"lookups\": " << stats.lookups << ", \"hits\": " << stats.hits
+             << ", \"hit_rate\": " << (stats.lookups ? (double)stats.hits / stats.lookups : 0.)
+             << ", \"bytes\": " << stats.bytes << ", \"evicted\": " << stats.evicted << "}, "
+             << "\"kv_pages\": {\"page_bytes\": " << pages.page_bytes << ", \"allocated\": " << pages.pages
+             << ", \"in_use\": " << pages.in_use << ", \"peak\": " << pages.peak << ", \"copies\": " << pages.copies << "}, "
+             << "\"pipeline\": {\"stages\": " << pipeline.stages << ", \"passes\": " << pipeline.passes
+             << ", \"micro_batches\": " << pipeline.micro_batches << ", \"ticks\": " << pipeline.ticks
+             << ", \"bubble\": " << pipeline.bubble() << ", \"idle\": " << pipeline.idle() << "}}\n";
+        res.set_content(body.str(), "application/json");
+    });
+
+    std::cout << "Serving on http://" << host << ":" << port << " with " << num_threads << " workers, max batch " << max_batch << std::endl;
+    if (!server.listen(host, port))
+        throw std::runtime_error("Error: could not listen on " + host + ":" + std::to_string(port) + ".");
+}
@@ -0,0 +1,22 @@
+#ifndef __SERVER_HPP__
+#define __SERVER_HPP__
+
+#include <string>
+
+#include "model.hpp"
+
+// HTTP inference server around an immutable, packed (or mapped) model.
+//
+//   GET|POST /generate?num_samples=N&temperature=T&max_tokens=M&seed=S&prompt=P
+//   -> {"samples": ["...", ...]}, every sample starts with the prompt
+//   GET /generate_stream?(same parameters)
+//   -> text/event-stream, one event per token as soon as it is sampled
+//   GET /stats
+//   -> {"prefix_cache": {"lookups": ..., "hits": ..., ...}, "kv_pages": {"in_use": ..., "peak": ..., ...},
+//       "pipeline": {"stages": ..., "bubble": ..., "idle": ..., ...}}
+//
+// http workers hand requests to a continuous batching scheduler, which decodes
+// the sequences of all in-flight requests together in batches of up to max_batch.
+void serve(const Model& model, int BOS, const std::string& host, int port, int num_threads, int max_batch);
+
+#endif
@@ -0,0 +1,168 @@
+#include "session.hpp"
+#include "data_loader.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+InferenceSession::InferenceSession(const Model& model, std::default_random_engine rng, PrefixCache* prefix_cache)
+    : model(model), cache(model.make_cache()), rng(rng), probs(model.vocab_size), prefix_cache(prefix_cache) {
+    // the largest pass is a prefill of a whole block
+    const size_t width = (size_t)model.block_size * model.n_embed;
+    cache.reserve(model.block_size);
+    for (std::vector<float>* buffer : {&scratch.x, &scratch.x_residual, &scratch.q, &scratch.k, &scratch.v, &scratch.x_attn})
+        buffer->reserve(width);
+    scratch.hidden.reserve(4 * width);
+    scratch.attn_logits.reserve((size_t)model.block_size * model.n_head * model.block_size);
+    scratch.logits.reserve(model.vocab_size);
+    scratch.xq.reserve((size_t)model.block_size * (4 * model.n_embed + 32));
+    scratch.x_scales.reserve(model.block_size);
+    scratch.x_padded.reserve((size_t)model.block_size * (4 * model.n_embed + 32));
+    scratch.pos_ids.reserve(model.block_size);
+    scratch.caches.reserve(model.block_size);
+    path.reserve(model.block_size);
+    blocks.reserve(model.block_size);
+}
+
+InferenceSession::InferenceSession(const Model& model, unsigned seed, PrefixCache* prefix_cache)
+    : InferenceSession(model, std::default_random_engine(seed), prefix_cache) {}
+
+void InferenceSession::check_token(int token_id) const {
+    if (token_id < 0 || token_id >= model.vocab_size)
+        throw std::runtime_error("Error: token " + std::to_string(token_id) + " is not in the vocabulary.");
+}
+
+// generations start from BOS, the prompt carries it first
+static void check_prompt(const std::vector<int>& prompt) {
+    if (prompt.empty())
+        throw std::runtime_error("Error: a prompt needs at least its BOS token.");
+}
+
+InferenceSession InferenceSession::fork(unsigned seed) const {
+    InferenceSession session(model, seed, prefix_cache);
+    session.cache = cache.fork();
+    session.cache.reserve(model.block_size);
+    session.path = path;
+    session.blocks = blocks;
+    session.scratch.logits.assign(scratch.logits.begin(), scratch.logits.end());
+    return session;
+}
+
+void InferenceSession::reset() {
+    cache.clear();
+    path.clear();
+    blocks.clear();
+}
+
+LogitsView InferenceSession::prefill(const int* token_ids, int n) {
+    if (n < 1 || cache.length + n > model.block_size)
+        throw std::runtime_error("Error: " + std::to_string(n) + " tokens do not fit into the session (" +
+                                 std::to_string(cache.length) + " of " + std::to_string(model.block_size) + " positions used).");
+    for (int i = 0; i < n; i++)
+        check_token(token_ids[i]);
+    if (cache.length == 0) {
+        // a fresh sequence can start from a cached prefix
+        path.assign(token_ids, token_ids + n);
+        model.start(path, cache, scratch, prefix_cache, blocks);
+        return view();
+    }
+
+    const int first = cache.length;
+    path.insert(path.end(), token_ids, token_ids + n);
+    model.prefill(token_ids, n, cache, scratch);
+    if (prefix_cache) {
+        for (int pos = first; pos < cache.length; pos++)
+            blocks.push_back(prefix_cache->capture(cache, pos, pos + 1 == cache.length ? scratch.logits.data() : nullptr, model.vocab_size));
+        prefix_cache->insert(path, blocks);
+    }
+    return view();
+}
+
+LogitsView InferenceSession::step(int token_id) {
+    if (cache.length >= model.block_size)
+        throw std::runtime_error("Error: session is full (" + std::to_string(model.block_size) + " positions).");
+    check_token(token_id);
+    path.push_back(token_id);
+    block_t block = prefix_cache ? prefix_cache->lookup(path) : nullptr;
+    if (block) {
+        // same prefix was computed before, take its keys, values and logits
+        prefix_cache->restore(*block, cache);
+        scratch.logits.assign(block->logits.begin(), block->logits.end());
+        blocks.push_back(std::move(block));
+        return view();
+    }
+
+    model.forward(token_id, cache.length, cache, scratch);
+    if (prefix_cache) {
+        blocks.push_back(prefix_cache->capture(cache, cache.length - 1, scratch.logits.data(), model.vocab_size));
+        prefix_cache->insert(path, blocks);
+    }
+    return view();
+}
+
+int InferenceSession::sample(float temperature) {
+    if (cache.length == 0)
+        throw std::runtime_error("Error: nothing to sample from, feed the session first.");
+    // NaN fails the comparison as well, and would silently sample BOS
+    if (!(temperature > 0.f))
+        throw std::runtime_error("Error: temperature must be positive, got " + std::to_string(temperature) + ".");
+    std::copy_n(scratch.logits.data(), model.vocab_size, probs.data());
+    return sample_token(probs.data(), model.vocab_size, temperature, rng);
+}
+
+float InferenceSession::score(const int* token_ids, int n) {
+    if (n < 2 || n > model.block_size + 1)
+        throw std::runtime_error("Error: can only score 2 to block_size + 1 tokens.");
+    reset();
+    float log_likelihood = 0.f;
+    for (int i = 0; i + 1 < n; i++) {
+        step(token_ids[i]);
+        std::copy_n(scratch.logits.data(), model.vocab_size, probs.data());
+        softmax_inplace(probs.data(), model.vocab_size);
+        check_token(token_ids[i + 1]);
+        log_likelihood += std::log(probs[token_ids[i + 1]]);
+    }
+    return log_likelihood;
+}
+
+Generator<int> InferenceSession::tokens(std::vector<int> prompt, float temperature, int max_tokens) {
+    check_prompt(prompt);
+    const int BOS = prompt[0];
+    const int max_length = std::min(max_tokens, model.block_size);
+
+    reset();
+    prefill(prompt.data(), prompt.size());
+    for (;;) {
+        const int token_id = sample(temperature);
+        if (token_id == BOS)
+            co_return;
+        co_yield token_id;
+        if (cache.length >= max_length)
+            co_return;
+        step(token_id);
+    }
+}
+
+std::vector<int> InferenceSession::generate(const std::vector<int>& prompt, float temperature, int max_tokens) {
+    check_prompt(prompt);
+    std::vector<int> document(prompt.begin() + 1, prompt.end());
+    for (int token_id : tokens(prompt, temperature, max_tokens))
+        document.push_back(token_id);
+    return document;
+}
+
+double mean_token_loss(const Model& model, const std::vector<std::string>& docs, int BOS, size_t* num_tokens) {
+    InferenceSession session(model);
+    double total = 0.;
+    size_t count = 0;
+    for (const std::string& doc : docs) {
+        std::vector<int> tokens = tokenize(doc, BOS);
+        if ((int)tokens.size() > model.block_size + 1)
+            tokens.resize(model.block_size + 1);
+        total -= session.score(tokens.data(), tokens.size());
+        count += tokens.size() - 1;
+    }
+    if (num_tokens)
+        *num_tokens = count;
+    return count ? total / count : 0.;
+}
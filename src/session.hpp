@@ -0,0 +1,79 @@
+#ifndef __SESSION_HPP__
+#define __SESSION_HPP__
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "generator.hpp"
+#include "model.hpp"
+#include "prefix_cache.hpp"
+
+// read-only row of logits, valid until the next call on its session
+struct LogitsView {
+    const float* data;
+    int size;
+
+    float operator[](int i) const { return data[i]; }
+    const float* begin() const { return data; }
+    const float* end() const { return data + size; }
+};
+
+// one sequence of incremental inference against an immutable model. the session
+// owns everything that changes while decoding (KV cache, activations, RNG), so
+// any number of sessions can run concurrently on different threads against the
+// same Model without locks. buffers are sized for block_size up front: stepping
+// and sampling do not allocate, apart from new prefix cache blocks if one is shared
+// and KV pages once the model's pool has none left.
+class InferenceSession {
+private:
+    const Model& model;
+    KVCache cache;
+    ForwardScratch scratch;
+    std::default_random_engine rng;
+    // temperature-scaled copy of the logits, sampling never touches the view
+    std::vector<float> probs;
+    // optional, may be shared by many sessions
+    PrefixCache* prefix_cache;
+    // inputs so far and their prefix cache blocks, pinned while the session holds them
+    std::vector<int> path;
+    std::vector<block_t> blocks;
+
+    void check_token(int token_id) const;
+    LogitsView view() const { return LogitsView{scratch.logits.data(), model.vocab_size}; }
+public:
+    InferenceSession(const Model& model, std::default_random_engine rng, PrefixCache* prefix_cache = nullptr);
+    InferenceSession(const Model& model, unsigned seed = 42, PrefixCache* prefix_cache = nullptr);
+
+    // a session continuing the same sequence with its own RNG. both share the
+    // KV pages written so far, a page is copied once either one writes to it
+    InferenceSession fork(unsigned seed) const;
+    // forget the sequence, its KV pages go back to the model's pool
+    void reset();
+    // feed n tokens at once (one batched pass), returns the logits after the last one
+    LogitsView prefill(const int* token_ids, int n);
+    // feed one token at the next position, returns the logits predicting its successor
+    LogitsView step(int token_id);
+    // draw the next token from the latest logits, temperature must be positive
+    int sample(float temperature = 1.f);
+    // log-likelihood of tokens[1..n) given everything before them, starts a new sequence
+    float score(const int* token_ids, int n);
+    // positions fed so far
+    int position() const { return cache.length; }
+
+    // coroutine yielding the tokens sampled after prompt (BOS first, never empty) one at a time,
+    // until BOS is drawn or the document is max_tokens long including the prompt.
+    // every resume is one decode step; the session must outlive the generator.
+    // it drives this session alone: concurrent generations are batched by the
+    // Scheduler (scheduler.hpp), which steps sequences without generators
+    Generator<int> tokens(std::vector<int> prompt, float temperature, int max_tokens);
+    // sample one whole document, the returned document includes the prompt
+    std::vector<int> generate(const std::vector<int>& prompt, float temperature, int max_tokens);
+};
+
+// average cross-entropy per predicted token of docs (BOS, chars..., BOS) on the
+// inference path, in whatever precision the model runs. num_tokens, if given,
+// receives the number of positions that were run
+double mean_token_loss(const Model& model, const std::vector<std::string>& docs, int BOS, size_t* num_tokens = nullptr);
+
+#endif
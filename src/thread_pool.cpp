@@ -0,0 +1,118 @@
+#include "thread_pool.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <utility>
+
+// index of the calling thread's queue in its pool, -1 outside of any pool
+static thread_local const ThreadPool* current_pool = nullptr;
+static thread_local int current_index = -1;
+
+ThreadPool::ThreadPool(int num_threads) {
+    const int workers = std::max(num_threads, 1) - 1;
+    for (int i = 0; i <= workers; i++)
+        queues.push_back(std::make_unique<Queue>());
+    for (int i = 0; i < workers; i++)
+        threads.emplace_back(&ThreadPool::work, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stop = true;
+    }
+    sleep_cv.notify_all();
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+ThreadPool& ThreadPool::global() {
+    static ThreadPool pool([] {
+        const char* threads = std::getenv("MICROGPT_THREADS");
+        return threads ? std::stoi(threads) : (int)std::max(1u, std::thread::hardware_concurrency());
+    }());
+    return pool;
+}
+
+void ThreadPool::submit(Task task) {
+    // workers keep their own tasks, everybody else shares the last queue
+    Queue& queue = current_pool == this ? *queues[current_index] : *queues.back();
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    queued.fetch_add(1, std::memory_order_release);
+    if (!threads.empty()) {
+        // taking the lock orders the wakeup after a worker's check for work
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+    }
+    sleep_cv.notify_one();
+}
+
+bool ThreadPool::pop(Queue& queue, bool back, Task& task) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+        return false;
+    if (back) {
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+    } else {
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+    }
+    queued.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool ThreadPool::run_one() {
+    if (queued.load(std::memory_order_acquire) == 0)
+        return false;
+    const int self = current_pool == this ? current_index : (int)queues.size() - 1;
+    Task task;
+    // own tasks newest first, then steal the oldest ones of the others
+    bool found = pop(*queues[self], true, task);
+    for (size_t i = 1; !found && i < queues.size(); i++)
+        found = pop(*queues[(self + i) % queues.size()], false, task);
+    if (!found)
+        return false;
+    task();
+    return true;
+}
+
+void ThreadPool::work(int index) {
+    current_pool = this;
+    current_index = index;
+    for (;;) {
+        if (run_one())
+            continue;
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        sleep_cv.wait(lock, [this] { return stop || queued.load(std::memory_order_acquire) > 0; });
+        if (stop)
+            return;
+    }
+}
+
+TaskGroup::~TaskGroup() {
+    // tasks refer to the group, never leave before they are done
+    drain();
+}
+
+// help with queued tasks, sleep when there are none left to take
+void TaskGroup::drain() {
+    while (pending.load(std::memory_order_acquire) > 0) {
+        if (pool.run_one())
+            continue;
+        // the timeout picks up tasks submitted while the others run
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait_for(lock, std::chrono::microseconds(100), [this] { return pending.load(std::memory_order_acquire) == 0; });
+    }
+    // the last task may still hold the lock it notified under
+    std::lock_guard<std::mutex> lock(mutex);
+}
+
+void TaskGroup::wait() {
+    drain();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (error)
+        std::rethrow_exception(std::exchange(error, nullptr));
+}
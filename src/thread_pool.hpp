@@ -0,0 +1,136 @@
+#ifndef __THREAD_POOL_HPP__
+#define __THREAD_POOL_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// work-stealing thread pool shared by every parallel part of the engine, so
+// nested parallelism never oversubscribes the cores. every worker owns a deque:
+// it pushes and pops its own tasks at the back (newest first, cache-warm) and
+// steals the oldest task at the front of another worker's deque when its own
+// is empty. tasks submitted from outside the pool go through a shared queue.
+// a thread waiting for tasks runs other tasks in the meantime, so a parallel
+// loop inside a task of another parallel loop cannot deadlock.
+class ThreadPool {
+private:
+    typedef std::function<void()> Task;
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // one per worker, the last one takes submissions from outside the pool
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cv;
+    std::atomic<size_t> queued{0};
+    bool stop = false;
+
+    void work(int index);
+    bool pop(Queue& queue, bool back, Task& task);
+public:
+    // num_threads counts the caller, which runs tasks while it waits: num_threads - 1 workers
+    explicit ThreadPool(int num_threads);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // the pool of the process: MICROGPT_THREADS threads, or one per core
+    static ThreadPool& global();
+    // threads that run tasks, the waiting caller included
+    int size() const { return (int)threads.size() + 1; }
+    void submit(Task task);
+    // run one queued task on the calling thread, false if there was none
+    bool run_one();
+};
+
+// a set of tasks that can be waited for. the first exception thrown by a task
+// is rethrown by wait()
+class TaskGroup {
+private:
+    ThreadPool& pool;
+    std::atomic<int> pending{0};
+    std::mutex mutex;
+    std::condition_variable done;
+    std::exception_ptr error;
+
+    void drain();
+public:
+    explicit TaskGroup(ThreadPool& pool = ThreadPool::global()) : pool(pool) {}
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+    ~TaskGroup();
+
+    template <typename F>
+    void run(F task) {
+        pending.fetch_add(1, std::memory_order_relaxed);
+        pool.submit([this, task = std::move(task)] {
+            try {
+                task();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+            // under the lock, so a waiter that saw the last task finish can
+            // destroy the group right away
+            std::lock_guard<std::mutex> lock(mutex);
+            if (pending.fetch_sub(1, std::memory_order_release) == 1)
+                done.notify_all();
+        });
+    }
+    // help running tasks until every task of the group finished
+    void wait();
+};
+
+// smallest number of items worth a task of their own, for items of work_per_item
+// units (e.g. multiply-adds): below min_work the scheduling costs more than it saves
+inline int grain_size(size_t work_per_item, size_t min_work = 1 << 15) {
+    return (int)std::max<size_t>(1, (min_work + work_per_item - 1) / std::max<size_t>(work_per_item, 1));
+}
+
+// f(first, last) over [begin, end) in chunks of at least grain items. the range
+// is halved recursively: one half is left for thieves, the other split further.
+// a range of at most grain items, or a pool of one thread, runs inline
+template <typename F>
+void parallel_for(int begin, int end, int grain, const F& f, ThreadPool& pool = ThreadPool::global()) {
+    if (end - begin <= grain || pool.size() == 1) {
+        if (begin < end)
+            f(begin, end);
+        return;
+    }
+    // split outlives the group, whose destructor waits for the queued halves
+    std::function<void(int, int)> split;
+    TaskGroup group(pool);
+    split = [&](int first, int last) {
+        while (last - first > grain) {
+            const int middle = first + (last - first) / 2;
+            group.run([&split, middle, last] { split(middle, last); });
+            last = middle;
+        }
+        f(first, last);
+    };
+    try {
+        split(begin, end);
+    } catch (...) {
+        // the queued halves still refer to f, let them finish before unwinding
+        try {
+            group.wait();
+        } catch (...) {
+        }
+        throw;
+    }
+    group.wait();
+}
+
+#endif
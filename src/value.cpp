@@ -23,21 +23,89 @@ Value::Value(float data, float grad, vector_t children, std::vector<float> local
     this->local_grads = std::move(local_grads);
 }
 
+Value::Value(Op op, vector_t children, float arg) {
+    this->children = std::move(children);
+    this->op = op;
+    this->arg = arg;
+    forward();
+}
+
 value_t Value::copy() {
-    return std::make_shared<Value>(data, grad, children, local_grads);
+    auto value = std::make_shared<Value>(data, grad, children, local_grads);
+    value->op = op;
+    value->arg = arg;
+    return value;
+}
+
+// single source of truth for every op's forward value and local derivatives,
+// used both when a node is created and when a captured graph is replayed
+void Value::forward() {
+    grad = 0.f;
+    switch (op) {
+    case Op::Leaf:
+        return;
+    case Op::Add:
+        data = children[0]->data + children[1]->data;
+        local_grads.assign({1.f, 1.f});
+        return;
+    case Op::Mul:
+        data = children[0]->data * children[1]->data;
+        local_grads.assign({children[1]->data, children[0]->data});
+        return;
+    case Op::Pow:
+        // high school math: dx**n/dx = n * x**(n - 1)
+        data = std::pow(children[0]->data, arg);
+        local_grads.assign({arg * std::pow(children[0]->data, arg - 1.f)});
+        return;
+    case Op::Exp:
+        // high school math: dexp(x)/dx = exp(x)
+        data = std::exp(children[0]->data);
+        local_grads.assign({std::exp(children[0]->data)});
+        return;
+    case Op::Log:
+        // high school math: dlog(x)/dx = 1 / x
+        data = std::log(children[0]->data);
+        local_grads.assign({1.f / children[0]->data});
+        return;
+    case Op::Relu:
+        data = std::max(children[0]->data, 0.f);
+        local_grads.assign({(float)(children[0]->data > 0)});
+        return;
+    case Op::Dot: {
+        // children are interleaved pairs (a[k], b[k]),
+        // grad of output w.r.t. a[k] is b[k]->data, and vice versa
+        const size_t n = children.size();
+        float result = 0.f;
+        local_grads.resize(n);
+        for (size_t k = 0; k < n; k += 2) {
+            const float a = children[k]->data;
+            const float b = children[k + 1]->data;
+            result += a * b;
+            local_grads[k] = b;
+            local_grads[k + 1] = a;
+        }
+        data = result;
+        return;
+    }
+    case Op::Max: {
+        // numerical stabilizer only, no gradient flows through it
+        float max_float = children[0]->data;
+        for (size_t i = 1; i < children.size(); i++)
+            max_float = std::max(max_float, children[i]->data);
+        data = max_float;
+        local_grads.assign(children.size(), 0.f);
+        return;
+    }
+    }
 }
 
 // binary ops
 value_t Value::operator+(const value_t& other) {
-    auto out_children = vector_t{shared_from_this(), other};
-    auto out_grads = std::vector<float>{1.f, 1.f};
-    return std::make_shared<Value>(data + other->data, std::move(out_children), std::move(out_grads));
+    return std::make_shared<Value>(Op::Add, vector_t{shared_from_this(), other});
 }
 
 value_t Value::operator*(const value_t& other) {
-    auto out_children = vector_t{shared_from_this(), other};
-    auto out_grads = std::vector<float>{other->data, this->data};
-    return std::make_shared<Value>(data * other->data, std::move(out_children), std::move(out_grads));
+    return std::make_shared<Value>(Op::Mul, vector_t{shared_from_this(), other});
 }
 
 value_t Value::operator-(const value_t& other) {
@@ -51,10 +119,8 @@ value_t Value::operator/(const value_t& other) {
 }
 
 value_t Value::pow(const value_t& other) {
-    auto out_children = vector_t{shared_from_this()};
-    // high school math: dx**n/dx = n * x**(n - 1)
-    auto out_grads = std::vector<float>{other->data * std::pow(this->data, other->data - 1.f)};
-    return std::make_shared<Value>(std::pow(data, other->data), std::move(out_children), std::move(out_grads));
+    // the exponent is a constant, so it is stored as the op argument instead of a child
+    return std::make_shared<Value>(Op::Pow, vector_t{shared_from_this()}, other->data);
 }
 
 // unary ops
@@ -63,23 +129,15 @@ value_t Value::operator-() {
 }
 
 value_t Value::exp() {
-    auto out_children = vector_t{shared_from_this()};
-    // high school math: dexp(x)/dx = exp(x)
-    auto out_grads = std::vector<float>{std::exp(this->data)};
-    return std::make_shared<Value>(std::exp(data), std::move(out_children), std::move(out_grads));
+    return std::make_shared<Value>(Op::Exp, vector_t{shared_from_this()});
 }
 
 value_t Value::log() {
-    auto out_children = vector_t{shared_from_this()};
-    // high school math: dlog(x)/dx = 1 / x
-    auto out_grads = std::vector<float>{1.f / this->data};
-    return std::make_shared<Value>(std::log(data), std::move(out_children), std::move(out_grads));
+    return std::make_shared<Value>(Op::Log, vector_t{shared_from_this()});
 }
 
 value_t Value::relu() {
-    auto out_children = vector_t{shared_from_this()};
-    auto out_grads = std::vector<float>{(float)(this->data > 0)};
-    return std::make_shared<Value>(std::max(this->data, 0.f), std::move(out_children), std::move(out_grads));
+    return std::make_shared<Value>(Op::Relu, vector_t{shared_from_this()});
 }
 
 // use raw pointer to avoid shared_ptr ref-counts
@@ -99,7 +157,11 @@ void Value::backward() {
 
     // build topology first
     build_topology(shared_from_this(), topology, visited);
+    backward(topology);
+}
 
+// backward pass over an already built topology ending in this node
+void Value::backward(const vector_t& topology) {
     // reset root grad
     grad = 1.f;
 
@@ -190,10 +252,7 @@ void prepare_tensors(std::vector<matrix_t>& keys, std::vector<matrix_t>& values,
 }
 
 value_t max(const vector_t& vec) {
-    float max_float = vec[0]->data;
-    for (size_t i = 1; i < vec.size(); i++)
-        max_float = std::max(max_float, vec[i]->data);
-    return value_from(max_float);
+    return std::make_shared<Value>(Op::Max, vec);
 }
 
 value_t sum(const vector_t& vec) {
@@ -211,23 +270,15 @@ value_t dot(const vector_t& a, const vector_t& b) {
     assert(a.size() == b.size());
     const size_t n = a.size();
 
-    // initializations
-    float result = 0.f;
+    // children interleaved as (a[k], b[k]), the Dot op computes result and local grads
     vector_t children;
-    std::vector<float> local_grads;
     children.reserve(2 * n);
-    local_grads.reserve(2 * n);
-
     for (size_t k = 0; k < n; k++) {
-        result += a[k]->data * b[k]->data;
-        // grad of output w.r.t. a[k] is b[k]->data, and vice versa
         children.push_back(a[k]);
         children.push_back(b[k]);
-        local_grads.push_back(b[k]->data);
-        local_grads.push_back(a[k]->data);
     }
 
-    return std::make_shared<Value>(result, std::move(children), std::move(local_grads));
+    return std::make_shared<Value>(Op::Dot, std::move(children));
 }
 
 // optimized dot for linears:
@@ -235,23 +286,12 @@ value_t dot(const vector_t& a, const vector_t& b) {
 // materializing a new sub-vector
 value_t dot_slice(const vector_t& a_full, int a_offset, const vector_t& b_full, int b_offset, int len) {
     assert(a_full.size() == b_full.size());
-    const size_t n = a_full.size();
 
-    // initializations
-    float result = 0.f;
     vector_t children;
-    std::vector<float> local_grads;
     children.reserve(2 * len);
-    local_grads.reserve(2 * len);
-
     for (int j = 0; j < len; j++) {
-        const value_t& a = a_full[a_offset + j];
-        const value_t& b = b_full[b_offset + j];
-        result += a->data * b->data;
-        children.push_back(a);
-        children.push_back(b);
-        local_grads.push_back(b->data);
-        local_grads.push_back(a->data);
+        children.push_back(a_full[a_offset + j]);
+        children.push_back(b_full[b_offset + j]);
     }
-    return std::make_shared<Value>(result, std::move(children), std::move(local_grads));
+    return std::make_shared<Value>(Op::Dot, std::move(children));
 }
@@ -1,10 +1,14 @@
 #ifndef __VALUE_HPP__
 #define __VALUE_HPP__
 
+#include <cstdint>
 #include <memory>
 #include <unordered_set>
 #include <vector>
 
+// operation that produced a node, kept so a captured graph can be recomputed in place
+enum class Op : uint8_t { Leaf, Add, Mul, Pow, Exp, Log, Relu, Dot, Max };
+
 class Value : public std::enable_shared_from_this<Value> {
     typedef std::shared_ptr<Value> value_t;
     typedef std::vector<value_t> vector_t;
@@ -15,8 +19,13 @@ private:
     vector_t children;
     // local partial derivatives with respect to this node's childrens
     std::vector<float> local_grads;
+    // producing op and its scalar argument (the exponent for Op::Pow)
+    Op op = Op::Leaf;
+    float arg = 0.f;
 
     void build_topology(value_t node, vector_t& topology, std::unordered_set<Value*>& visited);
+
+    friend class Graph;
 public:
     // store the actual value
     float data;
@@ -25,6 +34,10 @@ public:
 
     Value(float data, vector_t children = {}, std::vector<float> local_grads = {});
     Value(float data, float grad, vector_t children = {}, std::vector<float> local_grads = {});
+    Value(Op op, vector_t children, float arg = 0.f);
+
+    // (re)compute data and local grads from the current children, resets grad
+    void forward();
 
     // helper
     value_t copy();
@@ -43,6 +56,7 @@ public:
     value_t relu();
 
     void backward();
+    void backward(const vector_t& topology);
 
     // auxiliary overloads
     std::string to_string() const;
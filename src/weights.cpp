@@ -0,0 +1,196 @@
+#include "weights.hpp"
+#include "quant.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+static_assert(std::endian::native == std::endian::little, "weight file format assumes a little-endian host");
+
+static const char magic[8] = {'M', 'G', 'P', 'T', 'W', 'G', 'H', 'T'};
+static const uint32_t version = 2;
+// cache line (and AVX-512 register) alignment for every tensor
+static const uint32_t alignment = 64;
+
+static size_t align_up(size_t offset) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+// bounds-checked cursor over the mapped header
+class HeaderReader {
+private:
+    const char* data;
+    size_t length;
+    size_t offset = 0;
+public:
+    HeaderReader(const void* data, size_t length) : data(static_cast<const char*>(data)), length(length) {}
+
+    template <typename T>
+    T pod() {
+        if (offset + sizeof(T) > length)
+            throw std::runtime_error("Error: truncated weight file header.");
+        T value;
+        std::memcpy(&value, data + offset, sizeof(T));
+        offset += sizeof(T);
+        return value;
+    }
+
+    std::string str() {
+        uint32_t size = pod<uint32_t>();
+        if (offset + size > length)
+            throw std::runtime_error("Error: truncated weight file header.");
+        std::string value(data + offset, size);
+        offset += size;
+        return value;
+    }
+};
+
+WeightFile::WeightFile(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Error: could not open weight file \"" + path + "\".");
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(magic)) {
+        ::close(fd);
+        throw std::runtime_error("Error: \"" + path + "\" is not a weight file.");
+    }
+    length = st.st_size;
+    // MAP_SHARED read-only: pages come straight from the page cache, shared by every process
+    base = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        base = nullptr;
+        throw std::runtime_error("Error: could not map weight file \"" + path + "\".");
+    }
+
+    try {
+        HeaderReader header(base, length);
+        char file_magic[sizeof(magic)];
+        for (char& ch : file_magic)
+            ch = header.pod<char>();
+        if (!std::equal(file_magic, file_magic + sizeof(magic), magic))
+            throw std::runtime_error("Error: \"" + path + "\" is not a weight file.");
+        const uint32_t file_version = header.pod<uint32_t>();
+        if (file_version < 1 || file_version > version || header.pod<uint32_t>() != alignment)
+            throw std::runtime_error("Error: unsupported weight file version.");
+
+        for (int* dim : {&vocab_size, &n_embed, &n_head, &n_layer, &block_size})
+            *dim = header.pod<int32_t>();
+
+        uint32_t num_tensors = header.pod<uint32_t>();
+        for (uint32_t i = 0; i < num_tensors; i++) {
+            std::string name = header.str();
+            TensorType type = file_version >= 2 ? (TensorType)header.pod<uint32_t>() : TensorType::F32;
+            const int rows = header.pod<int32_t>();
+            const int cols = header.pod<int32_t>();
+            uint64_t offset = header.pod<uint64_t>();
+            uint64_t nbytes = header.pod<uint64_t>();
+            // negative dims would wrap around in the size computation below
+            if (rows <= 0 || cols <= 0)
+                throw std::runtime_error("Error: corrupt weight file tensor \"" + name + "\".");
+            const char* data = static_cast<const char*>(base) + offset;
+            const int groups = (int)(((int64_t)cols + 31) / 32);
+            uint64_t expected = type == TensorType::Q4 ? (uint64_t)rows * groups * sizeof(Q4Block) : (uint64_t)rows * cols * sizeof(float);
+            if ((type != TensorType::F32 && type != TensorType::Q4) || nbytes != expected || offset % alignment != 0 || offset > length ||
+                nbytes > length - offset)
+                throw std::runtime_error("Error: corrupt weight file tensor \"" + name + "\".");
+            if (type == TensorType::Q4)
+                q4_tensors[name] = Q4View{reinterpret_cast<const Q4Block*>(data), rows, cols, groups};
+            else
+                tensors[name] = WeightView{reinterpret_cast<const float*>(data), rows, cols};
+        }
+    } catch (...) {
+        ::munmap(base, length);
+        throw;
+    }
+    std::cout << "Mapped " << tensors.size() + q4_tensors.size() << " weight tensors (" << length << " bytes) from \"" << path << "\"" << std::endl;
+}
+
+WeightFile::~WeightFile() {
+    if (base)
+        ::munmap(base, length);
+}
+
+template <typename T>
+static void write_pod(std::ofstream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+static void write_string(std::ofstream& out, const std::string& str) {
+    write_pod(out, (uint32_t)str.size());
+    out.write(str.data(), str.size());
+}
+
+void WeightFile::write(const std::string& path, const Checkpoint& checkpoint, TensorType linear_type) {
+    // embedding tables are row lookups and always stay f32
+    std::vector<TensorType> types;
+    std::vector<std::vector<Q4Block>> q4_data(checkpoint.tensors.size());
+    for (size_t i = 0; i < checkpoint.tensors.size(); i++) {
+        const Tensor& tensor = checkpoint.tensors[i];
+        const bool embedding = tensor.name == "wte" || tensor.name == "wpe";
+        types.push_back(embedding ? TensorType::F32 : linear_type);
+        if (types.back() == TensorType::Q4)
+            q4_data[i] = quantize_q4(tensor.data.data(), tensor.rows, tensor.cols);
+    }
+    auto nbytes = [&](size_t i) {
+        return types[i] == TensorType::Q4 ? q4_data[i].size() * sizeof(Q4Block) : checkpoint.tensors[i].data.size() * sizeof(float);
+    };
+    auto bytes = [&](size_t i) {
+        return types[i] == TensorType::Q4 ? reinterpret_cast<const char*>(q4_data[i].data())
+                                          : reinterpret_cast<const char*>(checkpoint.tensors[i].data.data());
+    };
+
+    // header size first, so tensor offsets can be laid out behind it
+    size_t header_size = sizeof(magic) + 2 * sizeof(uint32_t) + 5 * sizeof(int32_t) + sizeof(uint32_t);
+    for (const Tensor& tensor : checkpoint.tensors)
+        header_size += 2 * sizeof(uint32_t) + tensor.name.size() + 2 * sizeof(int32_t) + 2 * sizeof(uint64_t);
+
+    std::vector<uint64_t> offsets;
+    size_t offset = align_up(header_size);
+    for (size_t i = 0; i < checkpoint.tensors.size(); i++) {
+        offsets.push_back(offset);
+        offset = align_up(offset + nbytes(i));
+    }
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open())
+        throw std::runtime_error("Error: could not open weight file \"" + path + "\" for writing.");
+
+    out.write(magic, sizeof(magic));
+    write_pod(out, version);
+    write_pod(out, alignment);
+    for (int dim : {checkpoint.vocab_size, checkpoint.n_embed, checkpoint.n_head, checkpoint.n_layer, checkpoint.block_size})
+        write_pod(out, (int32_t)dim);
+    write_pod(out, (uint32_t)checkpoint.tensors.size());
+    for (size_t i = 0; i < checkpoint.tensors.size(); i++) {
+        const Tensor& tensor = checkpoint.tensors[i];
+        write_string(out, tensor.name);
+        write_pod(out, (uint32_t)types[i]);
+        write_pod(out, (int32_t)tensor.rows);
+        write_pod(out, (int32_t)tensor.cols);
+        write_pod(out, offsets[i]);
+        write_pod(out, (uint64_t)nbytes(i));
+    }
+
+    for (size_t i = 0; i < checkpoint.tensors.size(); i++) {
+        // zero padding up to the aligned tensor offset
+        std::vector<char> padding(offsets[i] - (size_t)out.tellp(), 0);
+        out.write(padding.data(), padding.size());
+        out.write(bytes(i), nbytes(i));
+    }
+
+    if (!out.flush())
+        throw std::runtime_error("Error: failed writing weight file \"" + path + "\".");
+    std::cout << "Exported " << checkpoint.tensors.size() << " weight tensors to \"" << path << "\"";
+    if (linear_type == TensorType::Q4)
+        std::cout << " with q4 linear layers";
+    std::cout << std::endl;
+}
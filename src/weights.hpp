@@ -0,0 +1,81 @@
+#ifndef __WEIGHTS_HPP__
+#define __WEIGHTS_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "checkpoint.hpp"
+
+// non-owning view of a row-major float weight matrix, used by the
+// no-grad inference path. data points either into the model's own packed
+// buffer or directly into the pages of a mapped weight file.
+struct WeightView {
+    const float* data = nullptr;
+    int rows = 0;
+    int cols = 0;
+
+    const float* row(int r) const { return data + (size_t)r * cols; }
+};
+
+// 32 weights in 4 bits each with an fp16 scale: weight i is (nibble i - 8) * scale.
+// nibble i is the low half of qs[i] for i < 16, the high half of qs[i - 16] otherwise
+struct Q4Block {
+    uint16_t scale;
+    uint8_t qs[16];
+};
+static_assert(sizeof(Q4Block) == 18, "Q4Block must be packed");
+
+// non-owning view of a Q4 matrix. every row starts a new group, the last group
+// of a row is zero-padded when cols is not a multiple of 32
+struct Q4View {
+    const Q4Block* blocks = nullptr;
+    int rows = 0;
+    int cols = 0;
+    // groups per row
+    int groups = 0;
+
+    const Q4Block* row(int r) const { return blocks + (size_t)r * groups; }
+};
+
+// how a tensor is stored in a weight file
+enum class TensorType : uint32_t { F32 = 0, Q4 = 1 };
+
+// read-only, shared memory mapping of a weight file.
+//
+// layout (little-endian), safetensors-style:
+//   "MGPTWGHT" u32 version, u32 alignment
+//   i32 vocab_size, n_embed, n_head, n_layer, block_size
+//   u32 num_tensors, then per tensor: str name, u32 type, i32 rows, i32 cols, u64 offset, u64 nbytes
+//   raw tensor data (f32 floats or Q4 blocks), every tensor starting at a multiple of
+//   alignment from the file start
+// version 1 files have no type field, all of their tensors are f32.
+// where str is a u32 length followed by the raw bytes. tensors are used in place,
+// so cold start only costs page faults and all processes mapping the same file
+// share its physical pages through the page cache.
+class WeightFile {
+private:
+    void* base = nullptr;
+    size_t length = 0;
+public:
+    // model shape stored in the header
+    int vocab_size = 0;
+    int n_embed = 0;
+    int n_head = 0;
+    int n_layer = 0;
+    int block_size = 0;
+    std::map<std::string, WeightView> tensors;
+    std::map<std::string, Q4View> q4_tensors;
+
+    explicit WeightFile(const std::string& path);
+    ~WeightFile();
+    WeightFile(const WeightFile&) = delete;
+    WeightFile& operator=(const WeightFile&) = delete;
+
+    // write the weights (and shape) of a checkpoint as a weight file. linear_type
+    // selects the format of every matrix except the embedding tables
+    static void write(const std::string& path, const Checkpoint& checkpoint, TensorType linear_type = TensorType::F32);
+};
+
+#endif